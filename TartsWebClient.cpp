@@ -18,9 +18,16 @@
 #include <iostream>
 #include <sstream>
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <map>
+#include <vector>
 #include "http.cpp"
+#include "mqtt.cpp"
 
 /**********************************************************************************
  *BEAGLEBONE BLACK PLATFORM-SPECIFIC DEFINITIONS
@@ -37,211 +44,172 @@
 char thisSensorID[10];
 uint16_t thisSensorType;
 const char *GatewayId;
-Http http;
+uint32_t gatewayNumber; // GatewayId decoded once, as samples carry it
+uint32_t sampleSequence;
+std::unique_ptr<DeviceDataSink> deviceDataSink; // Http or MqttPublisher, created in setup
+AlarmDetector alarmDetector;
+int shutdownPipe[2]; // written to by TerminationHandler, polled by the main loop
+
+// Sensors found at run time, keyed by ID. With JOTTAI_SENSOR_REGISTRY set they are
+// written to that file when one is added and registered again at start, so they
+// are known before they next report.
+std::map<std::string, uint16_t> knownSensors;
+// Sensors handed to the library on first contact, remembered once they report,
+// as the library may still refuse to register them.
+std::map<std::string, uint16_t> admittedSensors;
 
-std::string CurrentTime()
+void SendDeviceDataEvent(const SensorMessage *msg)
 {
-    time_t currentTime;
-    time(&currentTime);
-
-    char currentTimeBuffer[sizeof "0000-00-00T00:00:00Z"];
-    strftime(currentTimeBuffer, sizeof currentTimeBuffer, "%FT%TZ", gmtime(&currentTime));
+    auto sample = MakeSensorSample(gatewayNumber, msg, time(NULL), sampleSequence++);
 
-    return std::string(currentTimeBuffer);
+    sample.priority = alarmDetector.Classify(sample);
+    deviceDataSink->EnqueueDeviceData(sample);
 }
 
-std::string GetPropertyType(const Datum &datum)
+void SaveSensorRegistry()
 {
-    if (datum.Name == std::string("RH"))
-    {
-        return std::string("RelativeHumidity");
-    }
-    else if (datum.Name == std::string("TEMPERATURE"))
+    auto path = getenv("JOTTAI_SENSOR_REGISTRY");
+
+    if (path == nullptr)
     {
-        return std::string("Temperature");
+        return;
     }
-    else if (datum.Name == std::string("CONTACT"))
+
+    auto temporaryPath = std::string(path) + ".tmp";
+    std::ofstream registry(temporaryPath, std::ios::trunc);
+
+    for (auto &sensor : knownSensors)
     {
-        return std::string("Contact");
+        registry << sensor.first << " " << sensor.second << "\n";
     }
-    else if (datum.Name == std::string("DETECT"))
+
+    registry.close();
+
+    if (!registry || rename(temporaryPath.c_str(), path) != 0)
     {
-        return std::string("PresenceOfWater");
+        std::cerr << "Could not write sensor registry " << path << std::endl;
     }
-    else if (datum.Name == std::string("PIR"))
+}
+
+void RememberSensor(const char *sensorID, uint16_t type)
+{
+    if (knownSensors.emplace(sensorID, type).second)
     {
-        return std::string("Motion");
+        SaveSensorRegistry();
     }
-    else if (datum.Name == std::string("ACTIVITY"))
+}
+
+void RegisterSensor(TartsSensorBase *sensor, const char *sensorID, uint16_t type, const char *sensorName)
+{
+    if (Tarts.RegisterSensor(GatewayId, sensor))
     {
-        return std::string("Motion");
+        RememberSensor(sensorID, type);
+        std::cout << sensorName << " (" << sensorID << "): Registered." << std::endl;
     }
     else
     {
-        return std::string(datum.Name);
+        std::cerr << sensorName << " (" << sensorID << "):f Registration Failed!" << std::endl;
     }
 }
 
-std::string GetValue(const Datum &datum)
+/**********************************************************************************
+ *Sniffer Create Sensor Function
+ *********************************************************************************/
+void CreateSensor(const char *sensorID, uint16_t type)
 {
-    if (datum.Name == std::string("RH"))
-    {
-        return std::to_string(std::stof(datum.Value) / 100.0f);
-    }
-    else if (datum.Name == std::string("TEMPERATURE"))
+    const SensorTypeInfo *sensorType = FindSensorType(type);
+
+    if (sensorType != nullptr)
     {
-        return std::to_string(std::stof(datum.Value) / 10.0f);
+        RegisterSensor(sensorType->create(sensorID), sensorID, type, sensorType->name);
     }
     else
     {
-        return datum.Value;
+        fprintf(stderr, "The sensor could not be registered because the Sensor Type %d is not recognized. \n", type);
     }
 }
 
-std::string GetValueType(const Datum &datum)
+void RestoreSensorRegistry()
 {
-    if (datum.Name == std::string("RH"))
+    auto path = getenv("JOTTAI_SENSOR_REGISTRY");
+
+    if (path == nullptr)
     {
-        return std::string("Decimal");
+        return;
     }
-    else if (datum.Name == std::string("Temperature"))
+
+    std::ifstream registry(path);
+    std::string sensorID;
+    uint16_t type;
+    std::vector<TartsSensorBase *> sensors;
+    std::vector<std::string> sensorIDs;
+
+    // Read straight into knownSensors: the file already lists them, so it is not rewritten
+    while (registry >> sensorID >> type)
     {
-        return std::string("Decimal");
+        const SensorTypeInfo *sensorType = FindSensorType(type);
+        TartsSensorBase *sensor = sensorType != nullptr ? sensorType->create(sensorID.c_str()) : nullptr;
+
+        if (sensor != nullptr && knownSensors.emplace(sensorID, type).second)
+        {
+            sensors.push_back(sensor);
+            sensorIDs.push_back(sensorID);
+        }
+        else
+        {
+            delete sensor;
+            std::cerr << "Skipping sensor " << sensorID << " of type " << type << " in the sensor registry" << std::endl;
+        }
     }
-    else
+
+    if (sensors.empty())
     {
-        return std::string("Integer");
+        return;
     }
-}
 
-void SendDeviceDataEvent(const SensorMessage *msg)
-{
-    std::stringstream json;
-
-    json
-        << "{ "
-        << "  \"gatewayId\": \"" << GatewayId << "\","
-        << "  \"deviceId\": \"" << msg->ID << "\","
-        << "  \"batteryVoltage\": \"" << msg->BatteryVoltage / 100 << "." << msg->BatteryVoltage % 100 << "\","
-        << "  \"rssi\": \"" << (int)msg->RSSI << "\","
-        << "  \"timestamp\": \"" << CurrentTime() << "\","
-        << "  \"protocol\": \"NotSpecified\","
-        << "  \"data\": [";
+    std::unique_ptr<bool[]> registered(new bool[sensors.size()]);
+    size_t rejected = 0;
 
-    for (int i = 0; i < msg->DatumCount; i++)
+    Tarts.RegisterSensors(GatewayId, sensors.data(), (int)sensors.size(), registered.get());
+
+    // The library keeps only the sensors it registered
+    for (size_t i = 0; i < sensors.size(); i++)
     {
-        json
-            << "  {"
-            << "    \"propertyId\": \"" << msg->DatumList[i].Name << "\","
-            << "    \"propertyType\": \"" << GetPropertyType(msg->DatumList[i]) << "\","
-            << "    \"propertyName\": \"" << msg->DatumList[i].Name << "\","
-            << "    \"propertyDescription\": \"" << msg->DatumList[i].Name << "\","
-            << "    \"valueType\": \"" << GetValueType(msg->DatumList[i]) << "\","
-            << "    \"value\": \"" << GetValue(msg->DatumList[i]) << "\""
-            << "  }";
-
-        if (i != (msg->DatumCount - 1))
+        if (!registered[i])
         {
-            json << ",";
+            knownSensors.erase(sensorIDs[i]);
+            delete sensors[i];
+            rejected++;
         }
     }
 
-    json << "]}";
+    if (rejected > 0)
+    {
+        std::cerr << rejected << " sensors of the sensor registry could not be registered" << std::endl;
+    }
 
-    http.EnqueueHttpMessageToAgent(HttpRequest("device-data", json, true, 20));
+    std::cout << "Registered " << sensors.size() - rejected << " sensors from the sensor registry" << std::endl;
 }
 
-void RegisterSensor(TartsSensorBase *sensor, const char *sensorID, const char *sensorName)
+TartsSensorBase *OnSensorAdmission(const char *sensorID, uint16_t type)
 {
-    if (Tarts.RegisterSensor(GatewayId, sensor))
-    {
-        std::cout << sensorName << " (" << sensorID << "): Registered." << std::endl;
-    }
-    else
+    const SensorTypeInfo *sensorType = FindSensorType(type);
+
+    if (sensorType == nullptr)
     {
-        std::cerr << sensorName << " (" << sensorID << "):f Registration Failed!" << std::endl;
+        return nullptr;
     }
-}
 
-/**********************************************************************************
- *Sniffer Create Sensor Function
- *********************************************************************************/
-void CreateSensor(const char *sensorID, uint16_t type)
-{
-    switch (type)
+    TartsSensorBase *sensor = sensorType->create(sensorID);
+
+    if (sensor != nullptr)
     {
-    case 1:
-        RegisterSensor(TartsMeasure1VDC::Create(sensorID), sensorID, "1 VDC Sensor");
-        break;
-    case 2:
-        RegisterSensor(TartsTemperature::Create(sensorID), sensorID, "Temperature Sensor");
-        break;
-    case 3:
-        RegisterSensor(TartsDryContact::Create(sensorID), sensorID, "Dry Contact Sensor");
-        break;
-    case 4:
-        RegisterSensor(TartsWaterDetect::Create(sensorID), sensorID, "Water Detection Sensor");
-        break;
-    case 5:
-        RegisterSensor(TartsActivity::Create(sensorID), sensorID, "Activity Sensor");
-        break;
-    case 9:
-        RegisterSensor(TartsOpenClose::Create(sensorID), sensorID, "Open Close Sensor");
-        break;
-    case 11:
-        RegisterSensor(TartsButton::Create(sensorID), sensorID, "Button Sensor");
-        break;
-    case 22:
-        RegisterSensor(TartsMeasure20mA::Create(sensorID), sensorID, "20 mA Current Sensor");
-        break;
-    case 23:
-        RegisterSensor(TartsPassiveIR::Create(sensorID), sensorID, "Passive IR Sensor");
-        break;
-    case 28:
-        RegisterSensor(TartsCompass::Create(sensorID), sensorID, "Compass Sensor");
-        break;
-    case 32:
-        RegisterSensor(TartsMeasure500VAC::Create(sensorID), sensorID, "500 VAC Sensor");
-        break;
-    case 43:
-        RegisterSensor(TartsHumidity::Create(sensorID), sensorID, "Humidity Sensor");
-        break;
-    case 59:
-        RegisterSensor(TartsMeasure50VDC::Create(sensorID), sensorID, "50 VDC Sensor");
-        break;
-    case 64:
-        RegisterSensor(TartsVACDetect::Create(sensorID), sensorID, "VAC Detect Sensor");
-        break;
-    case 65:
-        RegisterSensor(TartsWaterTemperature::Create(sensorID), sensorID, "Water Temperature Sensor");
-        break;
-    case 66:
-        RegisterSensor(TartsAsset::Create(sensorID), sensorID, "Assets Sensor");
-        break;
-    case 70:
-        RegisterSensor(TartsResistance::Create(sensorID), sensorID, "Resistance Sensor");
-        break;
-    case 71:
-        RegisterSensor(TartsVDCDetect::Create(sensorID), sensorID, "VDC Detect Sensor");
-        break;
-    case 72:
-        RegisterSensor(TartsMeasure5VDC::Create(sensorID), sensorID, "5 VDC Sensor");
-        break;
-    case 74:
-        RegisterSensor(TartsMeasure10VDC::Create(sensorID), sensorID, "10 VDC Sensor");
-        break;
-    case 75:
-        RegisterSensor(TartsTilt::Create(sensorID), sensorID, "Tilt Sensor");
-        break;
-    case 76:
-        RegisterSensor(TartsBasicControl::Create(sensorID), sensorID, "Basic Control Sensor");
-        break;
-    case 78:
-        RegisterSensor(TartsWaterRope::Create(sensorID), sensorID, "Water Rope Sensor");
-        break;
-    default:
-        fprintf(stderr, "The sensor could not be registered because the Sensor Type %d is not recognized. \n", thisSensorType);
+        std::cout << sensorType->name << " (" << sensorID << "): Admitted on first contact." << std::endl;
+        admittedSensors[sensorID] = type;
+        sensor->requestConfigurations();
     }
+
+    return sensor;
 }
 
 void OnGatewayMessageReceived(const char *gID, int stringID)
@@ -299,6 +267,17 @@ void OnSensorMessageReceived(SensorMessage *msg)
     printf("\n");
     fflush(stdout);
 
+    if (!admittedSensors.empty())
+    {
+        auto admitted = admittedSensors.find(msg->ID);
+
+        if (admitted != admittedSensors.end())
+        {
+            RememberSensor(admitted->first.c_str(), admitted->second);
+            admittedSensors.erase(admitted);
+        }
+    }
+
     SendDeviceDataEvent(msg);
 }
 
@@ -307,11 +286,21 @@ int setup()
     std::cout << "starting..." << std::endl;
 
     GatewayId = getenv("GATEWAY_ID");
+    gatewayNumber = Base36ArrayToInt(GatewayId);
 
-    RefreshAccessToken();
+    if (MqttSettings::IsConfigured())
+    {
+        deviceDataSink = std::make_unique<MqttPublisher>(MqttSettings::FromEnvironment(), DeviceDataBatchSettings::FromEnvironment().format);
+    }
+    else
+    {
+        accessTokens.Start();
+        deviceDataSink = std::make_unique<Http>();
+    }
 
     Tarts.RegisterEvent_GatewayMessage(OnGatewayMessageReceived);
     Tarts.RegisterEvent_SensorMessage(OnSensorMessageReceived);
+    Tarts.RegisterEvent_SensorAdmission(OnSensorAdmission);
 
     //Register Gateway
 #ifdef BB_BLACK_ARCH
@@ -325,21 +314,52 @@ int setup()
         return 1;
     }
 
+    RestoreSensorRegistry();
+
     std::cout << "started..." << std::endl;
 
     return 0;
 }
 
-void TerminationHandler(int signum)
+// Stops the radio and releases the cape first, then gives the sink until
+// JOTTAI_SHUTDOWN_TIMEOUT_MS to deliver or store what it holds.
+void Shutdown()
 {
-    exiting = true;
-    Tarts.RemoveGateway(GatewayId);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(EnvironmentOrDefault("JOTTAI_SHUTDOWN_TIMEOUT_MS", 10000));
+
     std::cout << "shutting down..." << std::endl;
-    exit(0);
+    Tarts.RemoveGateway(GatewayId);
+    deviceDataSink->Drain(deadline);
+    exiting = true;
+}
+
+// Only wakes up the main loop, the shutdown itself is not async-signal-safe.
+void TerminationHandler(int signum)
+{
+    char byte = (char)signum;
+
+    if (write(shutdownPipe[1], &byte, 1) < 0)
+    {
+        // the pipe is full, a shutdown is pending already
+    }
+}
+
+// Waits up to timeoutMs for a termination signal.
+bool ShutdownRequested(int timeoutMs)
+{
+    struct pollfd fd = {shutdownPipe[0], POLLIN, 0};
+
+    return poll(&fd, 1, timeoutMs) > 0;
 }
 
 int main(void)
 {
+    if (pipe2(shutdownPipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        perror("pipe2");
+        exit(1);
+    }
+
     if (signal(SIGINT, TerminationHandler) == SIG_IGN)
         signal(SIGINT, SIG_IGN);
     if (signal(SIGHUP, TerminationHandler) == SIG_IGN)
@@ -352,9 +372,12 @@ int main(void)
         exit(1);
     }
 
-    while (1)
+    do
     {
         Tarts.Process();
-        TARTS_DELAYMS(100);
-    }
+    } while (!ShutdownRequested(100));
+
+    Shutdown();
+
+    return 0;
 }
@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <time.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// How the readings of a device are thinned out when the backlog is over budget.
+enum class CoalescePolicy
+{
+    Latest, // keep only the latest reading
+    MinMax  // keep the latest reading and those with the lowest and highest first value
+};
+
+struct BacklogSettings
+{
+    size_t maxBytes;
+    std::chrono::seconds maxAge; // readings older than this are shed, 0 keeps all
+    CoalescePolicy policy;
+};
+
+// Sensor samples waiting for room in the uploader, queued per device. Readings
+// of a device are taken in order, devices take turns so that a chatty device does
+// not hold back the others. Once the readings take more than maxBytes every device
+// is coalesced down to the readings its policy keeps; if that is not enough the
+// caller evicts the oldest readings. Readings older than maxAge are shed when they
+// come up, so after an outage recent data is sent rather than hours of stale samples.
+//
+// Coalescing runs when an Add takes the backlog over budget and only visits the
+// devices that gained readings beyond what their policy keeps since it last ran.
+// Devices are indexed by the timestamp of their first reading, so evicting does
+// not scan them either.
+//
+// Not thread safe, used by the thread of the uploader that owns it.
+class DeviceBacklog
+{
+public:
+    explicit DeviceBacklog(BacklogSettings settings)
+        : settings(settings), bytes(0), shedReadings(0)
+    {
+    }
+
+    bool IsEmpty() const
+    {
+        return bytes == 0;
+    }
+
+    bool IsOverBudget() const
+    {
+        return bytes > settings.maxBytes;
+    }
+
+    void Add(const SensorSample &sample)
+    {
+        auto &device = devices[sample.deviceId];
+        bool wasOverBudget = IsOverBudget();
+
+        if (!device.inTurn)
+        {
+            device.inTurn = true;
+            ready.push_back(sample.deviceId);
+        }
+
+        bytes += EntryBytes;
+        device.readings.push_back(sample);
+
+        if (device.readings.size() == 1)
+        {
+            device.oldest = byOldest.emplace(sample.timestamp, sample.deviceId);
+        }
+        else if (device.readings.size() == KeptReadings() + 1)
+        {
+            coalescible.push_back(sample.deviceId);
+        }
+
+        if (IsOverBudget() && !wasOverBudget)
+        {
+            CoalesceAll();
+        }
+    }
+
+    // The next reading in turn that is not older than maxAge.
+    std::optional<SensorSample> Take(time_t now)
+    {
+        while (!ready.empty())
+        {
+            auto deviceId = ready.front();
+            auto device = devices.find(deviceId);
+
+            ready.pop_front();
+
+            // Its readings were all evicted
+            if (device->second.readings.empty())
+            {
+                devices.erase(device);
+
+                continue;
+            }
+
+            auto reading = PopFront(device->second);
+
+            if (!device->second.readings.empty())
+            {
+                ready.push_back(deviceId);
+            }
+            else
+            {
+                devices.erase(device);
+            }
+
+            if (settings.maxAge.count() > 0 && now - reading.timestamp > settings.maxAge.count())
+            {
+                shedReadings++;
+
+                continue;
+            }
+
+            return reading;
+        }
+
+        return std::nullopt;
+    }
+
+    // Removes the oldest reading of all devices, for when coalescing did not make
+    // the readings fit. A device left without readings keeps its turn until Take
+    // comes to it.
+    std::optional<SensorSample> EvictOldest()
+    {
+        if (byOldest.empty())
+        {
+            return std::nullopt;
+        }
+
+        return PopFront(devices[byOldest.begin()->second]);
+    }
+
+    // Readings shed or coalesced away since the last call.
+    size_t TakeShedReadings()
+    {
+        return std::exchange(shedReadings, 0);
+    }
+
+private:
+    static const size_t EntryBytes = sizeof(SensorSample) + sizeof(uint32_t); // with its turn in ready
+
+    typedef std::multimap<time_t, uint32_t> OldestIndex;
+
+    struct Device
+    {
+        std::deque<SensorSample> readings;
+        OldestIndex::iterator oldest; // entry of the first reading, unless there are none
+        bool inTurn = false;          // has an entry in ready
+    };
+
+    const BacklogSettings settings;
+
+    std::unordered_map<uint32_t, Device> devices;
+    std::deque<uint32_t> ready;        // devices with readings, in turn
+    OldestIndex byOldest;              // devices with readings by the timestamp of their first
+    std::vector<uint32_t> coalescible; // devices that grew past KeptReadings since CoalesceAll
+    size_t bytes;
+    size_t shedReadings;
+
+    static bool HasValue(const SensorSample &sample)
+    {
+        return sample.datumCount > 0 && sample.IsNumber(0);
+    }
+
+    size_t KeptReadings() const
+    {
+        return settings.policy == CoalescePolicy::MinMax ? 3 : 1;
+    }
+
+    SensorSample PopFront(Device &device)
+    {
+        auto reading = device.readings.front();
+
+        device.readings.pop_front();
+        bytes -= EntryBytes;
+        byOldest.erase(device.oldest);
+
+        if (!device.readings.empty())
+        {
+            device.oldest = byOldest.emplace(device.readings.front().timestamp, reading.deviceId);
+        }
+
+        return reading;
+    }
+
+    void CoalesceAll()
+    {
+        for (auto deviceId : coalescible)
+        {
+            auto device = devices.find(deviceId);
+
+            if (device != devices.end())
+            {
+                Coalesce(deviceId, device->second);
+            }
+        }
+
+        coalescible.clear();
+    }
+
+    void Coalesce(uint32_t deviceId, Device &device)
+    {
+        auto &readings = device.readings;
+
+        if (readings.size() <= KeptReadings())
+        {
+            return;
+        }
+
+        size_t minimum = readings.size() - 1;
+        size_t maximum = readings.size() - 1;
+
+        for (size_t i = 0; i < readings.size() && settings.policy == CoalescePolicy::MinMax; i++)
+        {
+            if (!HasValue(readings[i]))
+            {
+                continue;
+            }
+            if (!HasValue(readings[minimum]) || readings[i].datums[0].value < readings[minimum].datums[0].value)
+            {
+                minimum = i;
+            }
+            if (!HasValue(readings[maximum]) || readings[i].datums[0].value > readings[maximum].datums[0].value)
+            {
+                maximum = i;
+            }
+        }
+
+        std::deque<SensorSample> kept;
+
+        for (size_t i = 0; i < readings.size(); i++)
+        {
+            if (i == minimum || i == maximum || i == readings.size() - 1)
+            {
+                kept.push_back(readings[i]);
+            }
+            else
+            {
+                bytes -= EntryBytes;
+                shedReadings++;
+            }
+        }
+
+        readings.swap(kept);
+        byOldest.erase(device.oldest);
+        device.oldest = byOldest.emplace(readings.front().timestamp, deviceId);
+    }
+};
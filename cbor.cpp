@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+// Encodings the uploader can send device data in, told apart by the Content-Type.
+enum class WireFormat
+{
+    Json,
+    Cbor
+};
+
+const char *ContentType(WireFormat format)
+{
+    return format == WireFormat::Cbor ? "application/cbor" : "application/json";
+}
+
+// Minimal CBOR (RFC 8949) writer, just what the device data encoding needs.
+enum CborMajorType : uint8_t
+{
+    CborUnsigned = 0,
+    CborNegative = 1,
+    CborText = 3,
+    CborArray = 4,
+    CborMap = 5,
+    CborTag = 6,
+    CborSimple = 7
+};
+
+const uint64_t CborDecimalFractionTag = 4;
+const uint8_t CborNull = 0xF6;
+
+void AppendCborHead(std::string &buffer, CborMajorType majorType, uint64_t value)
+{
+    uint8_t type = majorType << 5;
+
+    if (value < 24)
+    {
+        buffer += (char)(type | value);
+    }
+    else if (value <= UINT8_MAX)
+    {
+        buffer += (char)(type | 24);
+        buffer += (char)value;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        buffer += (char)(type | 25);
+        buffer += (char)(value >> 8);
+        buffer += (char)value;
+    }
+    else if (value <= UINT32_MAX)
+    {
+        buffer += (char)(type | 26);
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            buffer += (char)(value >> shift);
+        }
+    }
+    else
+    {
+        buffer += (char)(type | 27);
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            buffer += (char)(value >> shift);
+        }
+    }
+}
+
+void AppendCborInteger(std::string &buffer, int64_t value)
+{
+    if (value < 0)
+    {
+        AppendCborHead(buffer, CborNegative, (uint64_t)(-1 - value));
+    }
+    else
+    {
+        AppendCborHead(buffer, CborUnsigned, (uint64_t)value);
+    }
+}
+
+void AppendCborFloat(std::string &buffer, float value)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    buffer += (char)((CborSimple << 5) | 26);
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        buffer += (char)(bits >> shift);
+    }
+}
+
+// Fixed-point value mantissa * 10^exponent as a decimal fraction (tag 4).
+void AppendCborDecimal(std::string &buffer, int64_t mantissa, int exponent)
+{
+    AppendCborHead(buffer, CborTag, CborDecimalFractionTag);
+    AppendCborHead(buffer, CborArray, 2);
+    AppendCborInteger(buffer, exponent);
+    AppendCborInteger(buffer, mantissa);
+}
@@ -0,0 +1,284 @@
+// Decodes the device-data batches written by DeviceDataBatch back into readings,
+// for the checks. Only what the serializer writes is understood. Included after
+// http.cpp, like http.cpp includes its parts.
+
+#include <math.h>
+
+struct DecodedReading
+{
+    uint32_t gatewayId = 0;
+    uint32_t deviceId = 0;
+    time_t timestamp = 0;
+    int batteryVoltage = 0; // hundredths of a volt
+    int rssi = 0;
+    std::vector<std::optional<double>> values;
+    uint32_t sequence = 0;
+    std::string idempotencyKey; // as sent in JSON, built from the elements of a CBOR reading
+};
+
+// Just enough of a CBOR decoder for the batches written by DeviceDataBatch.
+class CborReader
+{
+public:
+    explicit CborReader(std::string_view data)
+        : data(data), position(0), failed(false)
+    {
+    }
+
+    bool Failed() const
+    {
+        return failed;
+    }
+
+    bool AtEnd() const
+    {
+        return position == data.size();
+    }
+
+    uint64_t Head(CborMajorType majorType)
+    {
+        uint8_t majorTypeRead = 0;
+        auto value = Head(majorTypeRead);
+
+        if (majorTypeRead != majorType)
+        {
+            failed = true;
+        }
+
+        return value;
+    }
+
+    int64_t Integer()
+    {
+        uint8_t majorType = 0;
+        auto value = Head(majorType);
+
+        if (majorType == CborNegative)
+        {
+            return -1 - (int64_t)value;
+        }
+
+        if (majorType != CborUnsigned)
+        {
+            failed = true;
+        }
+
+        return (int64_t)value;
+    }
+
+    // A value of the values array: null, an integer, a decimal fraction or a float.
+    std::optional<double> Value()
+    {
+        if (Peek() == CborNull)
+        {
+            position++;
+
+            return std::nullopt;
+        }
+
+        if (Peek() == ((CborSimple << 5) | 26))
+        {
+            uint32_t bits = 0;
+            float value;
+
+            position++;
+            for (int i = 0; i < 4; i++)
+            {
+                bits = (bits << 8) | Byte();
+            }
+
+            memcpy(&value, &bits, sizeof(value));
+
+            return value;
+        }
+
+        if (Peek() >> 5 == CborTag)
+        {
+            if (Head(CborTag) != CborDecimalFractionTag || Head(CborArray) != 2)
+            {
+                failed = true;
+            }
+
+            auto exponent = Integer();
+            auto mantissa = Integer();
+
+            return mantissa * pow(10, exponent);
+        }
+
+        return (double)Integer();
+    }
+
+private:
+    uint8_t Peek() const
+    {
+        return position < data.size() ? (uint8_t)data[position] : 0;
+    }
+
+    uint8_t Byte()
+    {
+        if (position >= data.size())
+        {
+            failed = true;
+
+            return 0;
+        }
+
+        return (uint8_t)data[position++];
+    }
+
+    uint64_t Head(uint8_t &majorType)
+    {
+        auto initial = Byte();
+        auto additional = initial & 0x1F;
+        uint64_t value = 0;
+
+        majorType = initial >> 5;
+
+        if (additional < 24)
+        {
+            return additional;
+        }
+
+        if (additional > 27)
+        {
+            failed = true;
+
+            return 0;
+        }
+
+        for (int i = 0; i < 1 << (additional - 24); i++)
+        {
+            value = (value << 8) | Byte();
+        }
+
+        return value;
+    }
+
+    std::string_view data;
+    size_t position;
+    bool failed;
+};
+
+std::vector<DecodedReading> DecodeCborBatch(std::string_view body, bool &failed)
+{
+    CborReader reader(body);
+    std::vector<DecodedReading> readings;
+
+    if (reader.Head(CborMap) != 2 || reader.Head(CborUnsigned) != 0)
+    {
+        failed = true;
+
+        return readings;
+    }
+
+    auto baseTimestamp = reader.Integer();
+
+    reader.Head(CborUnsigned);
+
+    auto count = reader.Head(CborArray);
+
+    for (uint64_t i = 0; i < count && !reader.Failed(); i++)
+    {
+        DecodedReading reading;
+
+        if (reader.Head(CborArray) != 8)
+        {
+            break;
+        }
+
+        reading.timestamp = baseTimestamp + reader.Integer();
+        reading.gatewayId = reader.Head(CborUnsigned);
+        reading.deviceId = reader.Head(CborUnsigned);
+        reader.Head(CborUnsigned); // sensor type, JSON has no counterpart
+        reading.batteryVoltage = reader.Head(CborUnsigned);
+        reading.rssi = reader.Integer();
+
+        for (auto valueCount = reader.Head(CborArray); valueCount > 0; valueCount--)
+        {
+            reading.values.push_back(reader.Value());
+        }
+
+        reading.sequence = reader.Head(CborUnsigned);
+        reading.idempotencyKey = std::string(IntToBase36(reading.gatewayId).value) + "-" + IntToBase36(reading.deviceId).value + "-" +
+                                 std::to_string(reading.timestamp) + "-" + std::to_string(reading.sequence);
+        readings.push_back(reading);
+    }
+
+    failed = failed || reader.Failed() || !reader.AtEnd();
+
+    return readings;
+}
+
+// Splits the JSON batch into its reading objects, the serializer writes no braces
+// inside strings.
+std::vector<std::string> SplitJsonReadings(const std::string &body)
+{
+    std::vector<std::string> objects;
+    size_t start = 0;
+    int depth = 0;
+
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        if (body[i] == '{' && depth++ == 0)
+        {
+            start = i;
+        }
+        else if (body[i] == '}' && --depth == 0)
+        {
+            objects.push_back(body.substr(start, i - start + 1));
+        }
+    }
+
+    return objects;
+}
+
+std::vector<DecodedReading> DecodeJsonBatch(const std::string &body, bool &failed)
+{
+    std::vector<DecodedReading> readings;
+
+    for (auto &object : SplitJsonReadings(body))
+    {
+        DecodedReading reading;
+        auto gatewayId = FindJsonString(object, "gatewayId");
+        auto deviceId = FindJsonString(object, "deviceId");
+        auto batteryVoltage = FindJsonString(object, "batteryVoltage");
+        auto rssi = FindJsonString(object, "rssi");
+        auto key = FindJsonString(object, "idempotencyKey");
+        unsigned long long timestamp = 0;
+        unsigned int sequence = 0;
+        char keyGateway[16], keyDevice[16];
+
+        if (!gatewayId || !deviceId || !batteryVoltage || !rssi || !key ||
+            sscanf(key->c_str(), "%15[^-]-%15[^-]-%llu-%u", keyGateway, keyDevice, &timestamp, &sequence) != 4 ||
+            *gatewayId != keyGateway || *deviceId != keyDevice)
+        {
+            failed = true;
+            continue;
+        }
+
+        reading.gatewayId = Base36ArrayToInt(gatewayId->c_str());
+        reading.deviceId = Base36ArrayToInt(deviceId->c_str());
+        reading.timestamp = timestamp;
+        reading.batteryVoltage = (int)lround(strtod(batteryVoltage->c_str(), nullptr) * 100);
+        reading.rssi = atoi(rssi->c_str());
+        reading.sequence = sequence;
+        reading.idempotencyKey = *key;
+
+        for (auto position = object.find("\"value\":\""); position != std::string::npos; position = object.find("\"value\":\"", position + 1))
+        {
+            auto value = object.c_str() + position + 9;
+
+            reading.values.push_back(*value == '"' ? std::nullopt : std::optional<double>(strtod(value, nullptr)));
+        }
+
+        readings.push_back(reading);
+    }
+
+    return readings;
+}
+
+// A single reading is a batch of one in CBOR, in JSON it is a plain object.
+std::vector<DecodedReading> DecodeBatch(WireFormat format, std::string_view body, bool &failed)
+{
+    return format == WireFormat::Cbor ? DecodeCborBatch(body, failed) : DecodeJsonBatch(std::string(body), failed);
+}
@@ -0,0 +1,170 @@
+// Builds GWAPI data frames of several sensor types, Resistance values above 2^31
+// among them, and decodes them with TartsDecodeFrames in one batch and one frame at
+// a time. Checks that both give the same rows and that the raw values are the ones
+// written into the frames, so that wide unsigned values are not wrapped.
+//
+// Built and run by "make check".
+
+#include "TartsBatch.h"
+
+#include <string.h>
+
+#include <iostream>
+#include <vector>
+
+struct ExpectedRow
+{
+    uint32_t sensorId;
+    uint16_t sensorType;
+    int8_t rssi;
+    int64_t value1;
+    int64_t value2;
+};
+
+struct Capture
+{
+    std::vector<uint8_t> frames;
+    std::vector<ExpectedRow> rows;
+
+    // Appends a data frame with the sensor data field by field, as the gateway
+    // sends it. A frame with a broken CRC must not produce a row.
+    void Add(uint8_t command, const ExpectedRow &row, const std::vector<uint8_t> &data, bool brokenCrc = false)
+    {
+        uint8_t frame[TARTS_BATCH_FRAME_SIZE] = {0};
+        int header = command == 0x55 ? 9 : 13;
+        int length = header + 5 + data.size();
+
+        frame[0] = 0xC5;
+        frame[1] = length - 2;
+        frame[3] = command;
+        memcpy(&frame[4], &row.sensorId, 4);
+        frame[header] = row.rssi;
+        frame[header + 1] = 150;
+        frame[header + 2] = row.sensorType;
+        frame[header + 3] = row.sensorType >> 8;
+        memcpy(&frame[header + 5], data.data(), data.size());
+        frame[length] = Crc8(frame) ^ (brokenCrc ? 1 : 0);
+
+        frames.insert(frames.end(), frame, frame + sizeof(frame));
+
+        if (!brokenCrc)
+        {
+            rows.push_back(row);
+        }
+    }
+
+    size_t FrameCount() const
+    {
+        return frames.size() / TARTS_BATCH_FRAME_SIZE;
+    }
+
+private:
+    static uint8_t Crc8(const uint8_t *frame)
+    {
+        uint8_t crc = 0;
+
+        for (int i = 0; i < frame[1]; i++)
+        {
+            crc ^= frame[2 + i];
+
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = crc & 0x80 ? (crc << 1) ^ 0x97 : crc << 1;
+            }
+        }
+
+        return crc;
+    }
+};
+
+std::vector<uint8_t> LittleEndian(uint64_t value, int bytes)
+{
+    std::vector<uint8_t> data;
+
+    for (int i = 0; i < bytes; i++)
+    {
+        data.push_back(value >> (8 * i));
+    }
+
+    return data;
+}
+
+std::vector<uint8_t> Concat(std::vector<uint8_t> a, const std::vector<uint8_t> &b)
+{
+    a.insert(a.end(), b.begin(), b.end());
+
+    return a;
+}
+
+struct Columns
+{
+    std::vector<uint32_t> sensorId;
+    std::vector<uint16_t> sensorType;
+    std::vector<int8_t> rssi;
+    std::vector<int64_t> value1;
+    std::vector<int64_t> value2;
+
+    explicit Columns(size_t rows)
+        : sensorId(rows), sensorType(rows), rssi(rows), value1(rows), value2(rows)
+    {
+    }
+
+    TartsFrameColumns At(size_t row)
+    {
+        return {&sensorId[row], &sensorType[row], NULL, &rssi[row], NULL, NULL, &value1[row], &value2[row]};
+    }
+};
+
+int main()
+{
+    Capture capture;
+
+    capture.Add(0x55, {100384, Temperature, -60, -5, 0}, LittleEndian((uint16_t)-5, 2));
+    capture.Add(0x55, {100385, Humidity, -61, 5000, 2064}, Concat(LittleEndian(2064, 2), LittleEndian(5000, 2)));
+    capture.Add(0x55, {100386, Resistance, -62, 3000000000LL, 0}, LittleEndian(3000000000LL, 4));
+    capture.Add(0x55, {100387, Resistance, -63, 2147483648LL, 0}, LittleEndian(2147483648LL, 4), true);
+    capture.Add(0x56, {100388, Resistance, -64, 4294967295LL, 0}, LittleEndian(4294967295LL, 4));
+    capture.Add(0x56, {100389, Tilt, -65, -90, 45}, Concat(LittleEndian((uint16_t)-90, 2), LittleEndian(45, 2)));
+    capture.Add(0x55, {100390, Resistance, -66, 2147483648LL, 0}, LittleEndian(2147483648LL, 4));
+
+    Columns batch(capture.FrameCount());
+    Columns single(capture.FrameCount());
+    auto batchColumns = batch.At(0);
+    auto rows = TartsDecodeFrames(capture.frames.data(), capture.FrameCount(), TARTS_BATCH_FRAME_SIZE, NULL, &batchColumns);
+    size_t singleRows = 0;
+
+    for (size_t i = 0; i < capture.FrameCount(); i++)
+    {
+        auto singleColumns = single.At(singleRows);
+
+        singleRows += TartsDecodeFrames(&capture.frames[i * TARTS_BATCH_FRAME_SIZE], 1, TARTS_BATCH_FRAME_SIZE, NULL, &singleColumns);
+    }
+
+    if (rows != capture.rows.size() || singleRows != rows)
+    {
+        std::cerr << "FAIL: " << rows << " rows decoded in a batch and " << singleRows << " one frame at a time, expected " << capture.rows.size() << std::endl;
+
+        return 1;
+    }
+
+    for (size_t i = 0; i < rows; i++)
+    {
+        auto &expected = capture.rows[i];
+
+        for (auto columns : {&batch, &single})
+        {
+            if (columns->sensorId[i] != expected.sensorId || columns->sensorType[i] != expected.sensorType || columns->rssi[i] != expected.rssi ||
+                columns->value1[i] != expected.value1 || columns->value2[i] != expected.value2)
+            {
+                std::cerr << "FAIL: sensor " << expected.sensorId << " decoded " << (columns == &batch ? "in a batch" : "alone") << " as "
+                          << columns->value1[i] << ", " << columns->value2[i] << " instead of " << expected.value1 << ", " << expected.value2 << std::endl;
+
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "frame decode: " << rows << " of " << capture.FrameCount() << " frames decode to the same rows in a batch and one at a time" << std::endl;
+
+    return 0;
+}
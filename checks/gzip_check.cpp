@@ -0,0 +1,101 @@
+// Builds a device-data batch of 200 readings in each wire format and gzips it with
+// AgentConnection::Compress at JOTTAI_GZIP_LEVEL 1, 6 and 9. Checks that the body
+// inflates back to the batch and prints the bytes saved next to the CPU time spent
+// compressing and the time spent serializing and batching the readings.
+//
+// Built and run by "make check".
+
+#include "http.cpp"
+
+#include "checks/samples.cpp"
+
+std::string Inflate(const std::string &compressed)
+{
+    z_stream stream = {};
+    std::string inflated(256 * 1024, '\0');
+
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+    {
+        return std::string();
+    }
+
+    stream.next_in = (Bytef *)compressed.data();
+    stream.avail_in = compressed.size();
+    stream.next_out = (Bytef *)&inflated[0];
+    stream.avail_out = inflated.size();
+
+    auto result = inflate(&stream, Z_FINISH);
+
+    inflated.resize(result == Z_STREAM_END ? stream.total_out : 0);
+    inflateEnd(&stream);
+
+    return inflated;
+}
+
+// CPU time of the calling thread in microseconds.
+double ThreadMicroseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+bool CheckFormat(WireFormat format, const std::vector<SensorSample> &samples, int rounds)
+{
+    const char *name = format == WireFormat::Cbor ? "CBOR" : "JSON";
+    DeviceDataSerializer serializer;
+    auto start = ThreadMicroseconds();
+
+    for (int round = 1; round < rounds; round++)
+    {
+        BuildBatch(serializer, format, samples);
+    }
+
+    auto request = BuildBatch(serializer, format, samples);
+    auto batchTime = (ThreadMicroseconds() - start) / rounds;
+    auto body = request.Body();
+
+    std::cout << "  " << name << " batch " << body.size() << " bytes, built in " << batchTime << " us" << std::endl;
+
+    for (int level : {1, 6, 9})
+    {
+        AgentConnection connection("http://localhost/", false, {level, 0});
+
+        start = ThreadMicroseconds();
+
+        for (int round = 0; round < rounds; round++)
+        {
+            connection.Compress(body);
+        }
+
+        auto compressTime = (ThreadMicroseconds() - start) / rounds;
+
+        if (!connection.Compress(body) || Inflate(connection.compressedContent) != body)
+        {
+            std::cerr << "FAIL: " << name << " batch does not inflate back at level " << level << std::endl;
+
+            return false;
+        }
+
+        std::cout << "    level " << level << ": " << connection.compressedContent.size() << " bytes, "
+                  << body.size() - connection.compressedContent.size() << " saved in " << compressTime << " us" << std::endl;
+    }
+
+    return true;
+}
+
+int main()
+{
+    auto samples = MakeSamples(200);
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    std::cout << "gzip: 200 readings, per batch" << std::endl;
+
+    auto passed = CheckFormat(WireFormat::Json, samples, 200) && CheckFormat(WireFormat::Cbor, samples, 200);
+
+    curl_global_cleanup();
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+// Sends readings to a stand-in agent that stores each idempotency key once, spills
+// the same requests to an outbox, replays them from a reopened outbox as after a
+// restart and checks that every replayed reading has the key it was first sent
+// with, so the agent drops all of them as duplicates. Done for JSON and CBOR.
+//
+// Built and run by "make check".
+
+#include "http.cpp"
+
+#include "checks/decode.cpp"
+
+#include <set>
+
+// Stores a reading unless a reading with the same idempotency key is stored.
+struct StandInAgent
+{
+    std::set<std::string> keys;
+    size_t stored = 0;
+    size_t duplicates = 0;
+
+    std::vector<std::string> Receive(const HttpRequest &request, bool &failed)
+    {
+        std::vector<std::string> received;
+
+        for (auto &reading : DecodeBatch(request.format, request.Body(), failed))
+        {
+            if (keys.insert(reading.idempotencyKey).second)
+            {
+                stored++;
+            }
+            else
+            {
+                duplicates++;
+            }
+
+            received.push_back(reading.idempotencyKey);
+        }
+
+        return received;
+    }
+};
+
+SensorSample MakeSample(uint32_t deviceId, time_t timestamp, uint32_t sequence)
+{
+    SensorSample sample = {};
+
+    sample.gatewayId = 1234567;
+    sample.deviceId = deviceId;
+    sample.timestamp = timestamp;
+    sample.sequence = sequence;
+    sample.sensorType = Temperature;
+    sample.batteryVoltage = 301;
+    sample.rssi = -60;
+    sample.datumCount = 1;
+    sample.numberDatums = 1;
+    sample.datums[0] = {"Temperature", 200 + sequence};
+
+    return sample;
+}
+
+// A batch of readings and a single reading, as the uploader sends them.
+std::vector<HttpRequest> MakeRequests(WireFormat format)
+{
+    DeviceDataSerializer serializer;
+    DeviceDataBatch batch;
+    DeviceDataBatch single;
+    std::vector<HttpRequest> requests;
+    uint32_t sequence = 0;
+
+    batch.format = format;
+    single.format = format;
+
+    for (uint32_t deviceId = 100000; deviceId < 100010; deviceId++)
+    {
+        // Two readings of a sensor within a second differ only by their sequence
+        for (int i = 0; i < 2; i++)
+        {
+            auto sample = MakeSample(deviceId, 1700000000, ++sequence);
+
+            batch.Add(sample.deviceId, serializer.Serialize(format, sample), sample.timestamp);
+        }
+    }
+
+    requests.push_back(batch.Take());
+
+    auto sample = MakeSample(100000, 1700000001, ++sequence);
+
+    single.Add(sample.deviceId, serializer.Serialize(format, sample), sample.timestamp);
+    requests.push_back(single.Take());
+
+    return requests;
+}
+
+bool CheckReplay(WireFormat format, const std::string &directory)
+{
+    const char *name = format == WireFormat::Cbor ? "CBOR" : "JSON";
+    OutboxSettings settings = {directory, 4096, 1024 * 1024, 64 * 1024, std::chrono::milliseconds(1000)};
+    auto requests = MakeRequests(format);
+    StandInAgent agent;
+    std::vector<std::string> sentKeys;
+    std::vector<std::string> replayedKeys;
+    bool failed = false;
+
+    {
+        Outbox outbox;
+
+        if (!outbox.Open(settings))
+        {
+            return false;
+        }
+
+        for (auto &request : requests)
+        {
+            // The agent stored the readings but its response was lost
+            auto keys = agent.Receive(request, failed);
+
+            sentKeys.insert(sentKeys.end(), keys.begin(), keys.end());
+
+            if (!AppendToOutbox(outbox, 100000, request))
+            {
+                std::cerr << "FAIL: " << name << " request could not be spilled" << std::endl;
+
+                return false;
+            }
+        }
+    }
+
+    Outbox outbox;
+
+    outbox.Open(settings);
+
+    while (auto record = outbox.Next())
+    {
+        failed = failed || OrderingKeyFromOutbox(*record) != 100000;
+
+        auto keys = agent.Receive(RequestFromOutbox(*record), failed);
+
+        replayedKeys.insert(replayedKeys.end(), keys.begin(), keys.end());
+        outbox.Done(record->segment);
+    }
+
+    if (failed || sentKeys.size() != 21 || replayedKeys != sentKeys)
+    {
+        std::cerr << "FAIL: " << name << " readings replayed from the outbox do not have the keys they were sent with" << std::endl;
+
+        return false;
+    }
+
+    if (agent.stored != sentKeys.size() || agent.duplicates != replayedKeys.size() || outbox.HasBacklog())
+    {
+        std::cerr << "FAIL: " << name << " agent stored " << agent.stored << " readings and dropped " << agent.duplicates << " duplicates" << std::endl;
+
+        return false;
+    }
+
+    std::cout << "idempotency: " << name << " " << agent.stored << " readings stored, " << agent.duplicates << " replayed duplicates dropped" << std::endl;
+
+    return true;
+}
+
+int main()
+{
+    char directory[] = "/tmp/idempotency_check.XXXXXX";
+
+    if (mkdtemp(directory) == nullptr)
+    {
+        std::cerr << "FAIL: could not create " << directory << ": " << strerror(errno) << std::endl;
+
+        return 1;
+    }
+
+    auto passed = CheckReplay(WireFormat::Json, std::string(directory) + "/json") && CheckReplay(WireFormat::Cbor, std::string(directory) + "/cbor");
+
+    system((std::string("rm -rf ") + directory).c_str());
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+// Publishes readings to a stand-in broker on a loopback socket, for MQTT 3.1.1 and
+// MQTT 5. The broker checks the CONNECT and answers it with a CONNACK, acknowledges
+// the first PUBLISH and drops the connection with the others unacknowledged. After
+// the reconnect it checks that they are sent again with the DUP flag, the same
+// packet IDs and the same payloads, acknowledges them and expects the publisher to
+// drain and disconnect well before the deadline.
+//
+// Built and run by "make check".
+
+#include "http.cpp"
+#include "mqtt.cpp"
+
+#include "checks/decode.cpp"
+#include "checks/samples.cpp"
+
+struct BrokerPacket
+{
+    uint8_t header;
+    std::string body;
+};
+
+// Accepts two connections from the publisher and plays the broker's part on them.
+class StandInBroker
+{
+public:
+    StandInBroker(int protocolVersion, WireFormat format, size_t readings)
+        : protocolVersion(protocolVersion), format(format), readings(readings), listener(-1), port(0)
+    {
+        struct sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 4) != 0 ||
+            getsockname(listener, (struct sockaddr *)&address, &length) != 0)
+        {
+            error = std::string("could not listen on a loopback socket: ") + strerror(errno);
+
+            return;
+        }
+
+        port = ntohs(address.sin_port);
+        thread = std::thread(&StandInBroker::Run, this);
+    }
+
+    ~StandInBroker()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+
+        close(listener);
+    }
+
+    uint16_t Port() const
+    {
+        return port;
+    }
+
+    // Waits for the broker to finish, returns what went wrong, empty if nothing did.
+    std::string Error()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+
+        return error;
+    }
+
+private:
+    const int protocolVersion;
+    const WireFormat format;
+    const size_t readings;
+    int listener;
+    uint16_t port;
+    std::string error;
+    std::thread thread;
+
+    int Accept()
+    {
+        struct pollfd fds[1] = {{listener, POLLIN, 0}};
+
+        if (poll(fds, 1, 10000) <= 0)
+        {
+            return -1;
+        }
+
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        struct timeval timeout = {10, 0};
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        return fd;
+    }
+
+    static bool ReadPacket(int fd, BrokerPacket &packet)
+    {
+        uint8_t byte = 0;
+        size_t length = 0;
+
+        if (recv(fd, &packet.header, 1, MSG_WAITALL) != 1)
+        {
+            return false;
+        }
+
+        for (int shift = 0; shift < 28; shift += 7)
+        {
+            if (recv(fd, &byte, 1, MSG_WAITALL) != 1)
+            {
+                return false;
+            }
+
+            length |= (size_t)(byte & 0x7F) << shift;
+
+            if ((byte & 0x80) == 0)
+            {
+                break;
+            }
+        }
+
+        packet.body.assign(length, '\0');
+
+        return length == 0 || recv(fd, &packet.body[0], length, MSG_WAITALL) == (ssize_t)length;
+    }
+
+    static std::string Read16(const std::string &body, size_t position)
+    {
+        return body.size() < position + 2 ? std::string() : body.substr(position + 2, (uint8_t)body[position] << 8 | (uint8_t)body[position + 1]);
+    }
+
+    // Checks the CONNECT of the publisher and answers it.
+    bool Connect(int fd, bool sessionPresent)
+    {
+        BrokerPacket packet;
+
+        if (!ReadPacket(fd, packet) || packet.header >> 4 != MqttConnect || packet.body.size() < 10)
+        {
+            error = "no CONNECT received";
+
+            return false;
+        }
+
+        auto &body = packet.body;
+        size_t position = 10;
+
+        if (Read16(body, 0) != "MQTT" || body[6] != protocolVersion || (body[7] & 0x02) != 0)
+        {
+            error = "CONNECT has protocol level " + std::to_string(body[6]) + " or asks for a clean session";
+
+            return false;
+        }
+
+        if (protocolVersion == 5)
+        {
+            // Properties: just the session expiry interval
+            if (body.size() < 16 || body[10] != 5 || (uint8_t)body[11] != MqttSessionExpiryProperty)
+            {
+                error = "CONNECT has no session expiry interval";
+
+                return false;
+            }
+
+            position += 6;
+        }
+
+        if (Read16(body, position) != "mqtt-check")
+        {
+            error = "CONNECT has the wrong client ID";
+
+            return false;
+        }
+
+        std::string connAck = {(char)(sessionPresent ? 1 : 0), 0};
+
+        if (protocolVersion == 5)
+        {
+            connAck += (char)0; // no properties
+        }
+
+        return SendPacket(fd, MqttPacket(MqttConnAck, 0, connAck));
+    }
+
+    // Reads a QoS 1 PUBLISH and checks that its payload is the batch of one reading
+    // published on the reading's topic.
+    bool Publish(int fd, BrokerPacket &packet, uint16_t &packetId)
+    {
+        if (!ReadPacket(fd, packet) || packet.header >> 4 != MqttPublish || (packet.header & 0x06) != 0x02)
+        {
+            error = "no QoS 1 PUBLISH received";
+
+            return false;
+        }
+
+        auto topic = Read16(packet.body, 0);
+        auto position = 2 + topic.size() + 2 + (protocolVersion == 5 ? 1 : 0);
+        bool failed = false;
+
+        if (packet.body.size() < position)
+        {
+            error = "PUBLISH is too short";
+
+            return false;
+        }
+
+        packetId = (uint8_t)packet.body[2 + topic.size()] << 8 | (uint8_t)packet.body[3 + topic.size()];
+
+        auto decoded = DecodeBatch(format, std::string_view(packet.body).substr(position), failed);
+
+        if (failed || decoded.size() != 1 || topic != std::string("jottai/check/") + IntToBase36(decoded[0].deviceId).value)
+        {
+            error = "PUBLISH on " + topic + " does not carry a reading of that device";
+
+            return false;
+        }
+
+        return true;
+    }
+
+    bool PubAck(int fd, uint16_t packetId)
+    {
+        std::string body;
+
+        AppendMqttUint16(body, packetId);
+
+        return SendPacket(fd, MqttPacket(MqttPubAck, 0, body));
+    }
+
+    bool SendPacket(int fd, const std::string &packet)
+    {
+        if (send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) != (ssize_t)packet.size())
+        {
+            error = std::string("could not send to the publisher: ") + strerror(errno);
+
+            return false;
+        }
+
+        return true;
+    }
+
+    void Run()
+    {
+        std::vector<BrokerPacket> unacknowledged;
+        int fd = Accept();
+
+        if (fd < 0 || !Connect(fd, false))
+        {
+            error = fd < 0 ? "the publisher did not connect" : error;
+            close(fd);
+
+            return;
+        }
+
+        for (size_t i = 0; i < readings; i++)
+        {
+            BrokerPacket packet;
+            uint16_t packetId = 0;
+
+            if (!Publish(fd, packet, packetId) || (packet.header & 0x08) != 0)
+            {
+                error = error.empty() ? "first PUBLISH has the DUP flag" : error;
+                close(fd);
+
+                return;
+            }
+
+            if (i > 0)
+            {
+                unacknowledged.push_back(packet);
+            }
+            else if (!PubAck(fd, packetId))
+            {
+                close(fd);
+
+                return;
+            }
+        }
+
+        // Drops the connection with the other readings in flight
+        close(fd);
+        fd = Accept();
+
+        if (fd < 0 || !Connect(fd, true))
+        {
+            error = fd < 0 ? "the publisher did not reconnect" : error;
+            close(fd);
+
+            return;
+        }
+
+        for (auto &sent : unacknowledged)
+        {
+            BrokerPacket packet;
+            uint16_t packetId = 0;
+
+            if (!Publish(fd, packet, packetId) || packet.header != (sent.header | 0x08) || packet.body != sent.body)
+            {
+                error = error.empty() ? "PUBLISH in flight was not sent again as it was with the DUP flag" : error;
+                close(fd);
+
+                return;
+            }
+
+            if (!PubAck(fd, packetId))
+            {
+                close(fd);
+
+                return;
+            }
+        }
+
+        BrokerPacket packet;
+
+        if (!ReadPacket(fd, packet) || packet.header >> 4 != MqttDisconnect)
+        {
+            error = "the publisher did not drain and disconnect";
+        }
+
+        close(fd);
+    }
+};
+
+bool CheckVersion(int protocolVersion, WireFormat format)
+{
+    const size_t readings = 3;
+    StandInBroker broker(protocolVersion, format, readings);
+    MqttSettings settings = {"127.0.0.1", std::to_string(broker.Port()), "mqtt-check", "", "", "jottai/check", protocolVersion,
+                             std::chrono::seconds(60), std::chrono::seconds(5), 3600, 10, 64};
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        MqttPublisher publisher(settings, format);
+
+        for (auto &sample : MakeSamples(readings))
+        {
+            // Recent enough for the backlog to keep
+            sample.timestamp = time(NULL);
+            publisher.EnqueueDeviceData(sample);
+        }
+
+        publisher.Drain(start + std::chrono::seconds(10));
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    auto error = broker.Error();
+
+    if (error.empty() && elapsed >= 10000)
+    {
+        error = "the publisher drained only at the deadline";
+    }
+
+    if (!error.empty())
+    {
+        std::cerr << "FAIL: MQTT " << protocolVersion << ": " << error << std::endl;
+
+        return false;
+    }
+
+    std::cout << "mqtt: version " << protocolVersion << " connected twice, " << readings - 1 << " readings sent again with DUP, all acknowledged in " << elapsed << " ms" << std::endl;
+
+    return true;
+}
+
+int main()
+{
+    // Readings must not come from or go to an outbox left by another run
+    unsetenv("JOTTAI_OUTBOX_DIR");
+
+    auto passed = CheckVersion(4, WireFormat::Json) && CheckVersion(5, WireFormat::Cbor);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+// Sensor samples and batches of them for the checks, included after http.cpp.
+
+#include <random>
+
+// count samples of a mix of sensor types, the same on every call.
+std::vector<SensorSample> MakeSamples(size_t count)
+{
+    struct SampleKind
+    {
+        uint16_t sensorType;
+        uint8_t datumCount;
+        const char *names[2];
+        int64_t minValue;
+        int64_t maxValue;
+    };
+
+    const SampleKind kinds[] = {
+        {Temperature, 1, {"Temperature"}, -400, 1250},
+        {Humidity, 2, {"RelativeHumidity", "Temperature"}, -4000, 10000},
+        {Measure1VDC, 1, {"Voltage"}, 0, 1000},
+        {Tilt, 2, {"Pitch", "Roll"}, -180, 180},
+        {WaterDetect, 1, {"PresenceOfWater"}, 0, 1},
+        {Resistance, 1, {"Resistance"}, 0, UINT32_MAX},
+        {Asset, 1, {"Asset"}, 0, 0}};
+
+    std::mt19937 random(42);
+    std::vector<SensorSample> samples;
+    time_t timestamp = 1700000000;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto &kind = kinds[i % (sizeof(kinds) / sizeof(kinds[0]))];
+        SensorSample sample = {};
+
+        sample.gatewayId = 1234567;
+        sample.deviceId = 100000 + i % 40;
+        sample.timestamp = timestamp += random() % 3;
+        sample.sequence = i + 1;
+        sample.sensorType = kind.sensorType;
+        sample.batteryVoltage = 250 + random() % 80;
+        sample.rssi = -(int)(random() % 100);
+        sample.datumCount = kind.datumCount;
+
+        for (int d = 0; d < kind.datumCount; d++)
+        {
+            sample.datums[d].name = kind.names[d];
+            sample.datums[d].value = kind.minValue + (int64_t)(random() % (uint64_t)(kind.maxValue - kind.minValue + 1));
+            sample.numberDatums |= kind.sensorType != Asset ? 1 << d : 0;
+        }
+
+        samples.push_back(sample);
+    }
+
+    return samples;
+}
+
+HttpRequest BuildBatch(DeviceDataSerializer &serializer, WireFormat format, const std::vector<SensorSample> &samples)
+{
+    DeviceDataBatch batch;
+
+    batch.format = format;
+
+    for (auto &sample : samples)
+    {
+        batch.Add(sample.deviceId, serializer.Serialize(format, sample), sample.timestamp);
+    }
+
+    return batch.Take();
+}
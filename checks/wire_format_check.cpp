@@ -0,0 +1,95 @@
+// Encodes the same sensor samples as a JSON and a CBOR device-data batch, decodes
+// both and checks that every reading carries the same IDs, timestamp, battery
+// voltage, RSSI, values, sequence and idempotency key. Prints the size of the
+// batches and the time spent serializing and batching a reading in each format.
+//
+// Built and run by "make check".
+
+#include "http.cpp"
+
+#include "checks/decode.cpp"
+#include "checks/samples.cpp"
+
+bool SameValue(const std::optional<double> &a, const std::optional<double> &b)
+{
+    if (!a || !b)
+    {
+        return !a && !b;
+    }
+
+    // JSON carries the scaled value with six decimals
+    return fabs(*a - *b) <= 1e-6 * std::max(1.0, fabs(*a));
+}
+
+bool SameReading(const DecodedReading &a, const DecodedReading &b)
+{
+    if (a.gatewayId != b.gatewayId || a.deviceId != b.deviceId || a.timestamp != b.timestamp ||
+        a.batteryVoltage != b.batteryVoltage || a.rssi != b.rssi || a.sequence != b.sequence || a.idempotencyKey != b.idempotencyKey ||
+        a.values.size() != b.values.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.values.size(); i++)
+    {
+        if (!SameValue(a.values[i], b.values[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Serializing and batching time per reading in nanoseconds.
+double TimeBatches(WireFormat format, const std::vector<SensorSample> &samples, int rounds)
+{
+    DeviceDataSerializer serializer;
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int round = 0; round < rounds; round++)
+    {
+        bytes += BuildBatch(serializer, format, samples).Body().size();
+    }
+
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    return bytes > 0 ? elapsed / rounds / samples.size() : 0;
+}
+
+int main()
+{
+    const size_t count = 200;
+    const int rounds = 500;
+    auto samples = MakeSamples(count);
+    DeviceDataSerializer serializer;
+    auto json = BuildBatch(serializer, WireFormat::Json, samples);
+    auto cbor = BuildBatch(serializer, WireFormat::Cbor, samples);
+    bool failed = false;
+    auto fromJson = DecodeJsonBatch(std::string(json.Body()), failed);
+    auto fromCbor = DecodeCborBatch(cbor.Body(), failed);
+
+    if (failed || fromJson.size() != count || fromCbor.size() != count)
+    {
+        std::cerr << "FAIL: could not decode the batches (" << fromJson.size() << " JSON and " << fromCbor.size() << " CBOR readings of " << count << ")" << std::endl;
+
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!SameReading(fromJson[i], fromCbor[i]) || fromCbor[i].sequence != samples[i].sequence || fromCbor[i].deviceId != samples[i].deviceId)
+        {
+            std::cerr << "FAIL: reading " << i << " differs between JSON and CBOR" << std::endl;
+
+            return 1;
+        }
+    }
+
+    std::cout << "wire format: " << count << " readings match" << std::endl;
+    std::cout << "  JSON " << json.Body().size() << " bytes, " << TimeBatches(WireFormat::Json, samples, rounds) << " ns per reading" << std::endl;
+    std::cout << "  CBOR " << cbor.Body().size() << " bytes, " << TimeBatches(WireFormat::Cbor, samples, rounds) << " ns per reading" << std::endl;
+
+    return 0;
+}
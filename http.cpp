@@ -1,40 +1,243 @@
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <sstream>
-#include <queue>
-#include <regex>
+#include <string_view>
 #include <thread>
+#include <vector>
 
-std::string accessToken = "";
-bool exiting = false;
+#include "cbor.cpp"
+#include "sink.cpp"
+#include "sensors.cpp"
+#include "serializer.cpp"
+#include "backlog.cpp"
+#include "outbox.cpp"
+#include "queue.cpp"
 
+std::atomic<bool> exiting(false);
+
+// A request and its body. Requests are moved from where they are built through the
+// queues to libcurl, which sends the body straight from content, so they cannot be
+// copied. The body starts at bodyOffset: batches leave room at the start of their
+// buffer and put the head in front of the readings once they know the count.
 struct HttpRequest
 {
-    const std::string path;
-    const std::string jsonContent;
-    const bool isPost;
-    const long timeout;
+    std::string path;
+    std::string content;
+    size_t bodyOffset;
+    WireFormat format;
+    bool isPost;
+    long timeout;
+
+    HttpRequest(std::string path, std::string jsonContent, bool isPost, long timeout)
+        : HttpRequest(std::move(path), std::move(jsonContent), WireFormat::Json, isPost, timeout)
+    {
+    }
+
+    HttpRequest(std::string path, std::string content, WireFormat format, bool isPost, long timeout, size_t bodyOffset = 0)
+        : path(std::move(path)), content(std::move(content)), bodyOffset(bodyOffset), format(format), isPost(isPost), timeout(timeout)
+    {
+    }
+
+    HttpRequest(HttpRequest &&) = default;
+    HttpRequest &operator=(HttpRequest &&) = default;
+
+    std::string_view Body() const
+    {
+        return std::string_view(content).substr(bodyOffset);
+    }
+};
+
+// Request buffers kept for reuse once their request is done, so that batches stop
+// allocating when the buffers have grown to the usual request size. Buffers larger
+// than maxBufferBytes are freed. Not thread safe, used by the uploader thread.
+class RequestBufferPool
+{
+public:
+    RequestBufferPool(size_t maxBuffers, size_t maxBufferBytes)
+        : maxBuffers(maxBuffers), maxBufferBytes(maxBufferBytes)
+    {
+    }
+
+    std::string Take()
+    {
+        if (buffers.empty())
+        {
+            return std::string();
+        }
+
+        auto buffer = std::move(buffers.back());
+
+        buffers.pop_back();
+
+        return buffer;
+    }
+
+    void Return(std::string buffer)
+    {
+        if (buffers.size() < maxBuffers && buffer.capacity() <= maxBufferBytes)
+        {
+            buffer.clear();
+            buffers.push_back(std::move(buffer));
+        }
+    }
+
+private:
+    const size_t maxBuffers;
+    const size_t maxBufferBytes;
+    std::vector<std::string> buffers;
+};
+
+long EnvironmentOrDefault(const char *name, long defaultValue)
+{
+    auto value = getenv(name);
+
+    return value != nullptr ? atol(value) : defaultValue;
+}
+
+// Device data readings are collected into one JSON array per request. A batch is
+// flushed when it reaches maxReadings or maxBytes, or when its oldest reading has
+// waited for linger. A batch holding a single reading is sent as a plain JSON
+// object, as before batching existed, so a maxReadings of 1 disables batching.
+//
+// With JOTTAI_WIRE_FORMAT=cbor readings are sent as application/cbor instead. A
+// batch is the map {0: time of the first reading, 1: [readings]}, each reading the
+// array [seconds since the batch time, gateway ID, device ID, sensor type, battery
+// voltage in hundredths of a volt, RSSI, [values], sequence]. IDs are the numeric
+// Tarts IDs and scaled values are decimal fractions (tag 4) of the raw sensor value.
+//
+// Every reading carries an idempotency key, so the agent can drop readings it has
+// already stored when a request is retried after its response was lost, or when it
+// comes back from the outbox. In JSON it is the idempotencyKey field, made of the
+// gateway ID, device ID, timestamp and sequence number of the reading; in CBOR the
+// agent builds it from the same elements of the array.
+struct DeviceDataBatchSettings
+{
+    size_t maxReadings;
+    size_t maxBytes;
+    std::chrono::milliseconds linger;
+    WireFormat format;
+
+    static DeviceDataBatchSettings FromEnvironment()
+    {
+        auto format = getenv("JOTTAI_WIRE_FORMAT");
+
+        return {
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_BATCH_MAX_READINGS", 200)),
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_BATCH_MAX_BYTES", 64 * 1024)),
+            std::chrono::milliseconds(EnvironmentOrDefault("JOTTAI_BATCH_LINGER_MS", 2000)),
+            format != nullptr && strcmp(format, "cbor") == 0 ? WireFormat::Cbor : WireFormat::Json};
+    }
+};
+
+// Readings are written to the buffer that becomes the request body, after HeadRoom
+// bytes left for the JSON array bracket or the CBOR map and array heads.
+struct DeviceDataBatch
+{
+    static const size_t HeadRoom = 24;
+
+    WireFormat format = WireFormat::Json;
+    RequestBufferPool *pool = nullptr; // where the buffers of new batches come from, if set
+    uint32_t orderingKey = 0; // of the first reading, any reading's key selects the same lane
+    std::string readings;
+    size_t count = 0;
+    time_t baseTimestamp = 0;
+    std::chrono::steady_clock::time_point firstReadingTime;
+
+    bool IsEmpty() const
+    {
+        return count == 0;
+    }
+
+    size_t Size() const
+    {
+        return count > 0 ? readings.size() - HeadRoom : 0;
+    }
+
+    bool WouldOverflow(const std::string &reading, const DeviceDataBatchSettings &settings) const
+    {
+        return count > 0 && Size() + reading.size() + 2 > settings.maxBytes;
+    }
+
+    bool IsFull(const DeviceDataBatchSettings &settings) const
+    {
+        return count >= settings.maxReadings || Size() + 2 >= settings.maxBytes;
+    }
 
-    HttpRequest(const std::string path, const std::string jsonContent, bool isPost, long timeout)
-        : path(path), jsonContent(jsonContent), isPost(isPost), timeout(timeout)
+    std::chrono::steady_clock::time_point FlushTime(const DeviceDataBatchSettings &settings) const
     {
+        return firstReadingTime + settings.linger;
     }
 
-    HttpRequest(const std::string path, const std::stringstream &jsonContent, bool isPost, long timeout)
-        : path(path), jsonContent(jsonContent.str()), isPost(isPost), timeout(timeout)
+    void Add(uint32_t readingOrderingKey, const std::string &reading, time_t timestamp)
     {
+        if (count == 0)
+        {
+            if (pool != nullptr && readings.capacity() == 0)
+            {
+                readings = pool->Take();
+            }
+
+            readings.assign(HeadRoom, ' ');
+            orderingKey = readingOrderingKey;
+            baseTimestamp = timestamp;
+            firstReadingTime = std::chrono::steady_clock::now();
+        }
+        else if (format == WireFormat::Json)
+        {
+            readings += ",";
+        }
+
+        if (format == WireFormat::Cbor)
+        {
+            AppendCborHead(readings, CborArray, 8);
+            AppendCborInteger(readings, timestamp - baseTimestamp);
+        }
+
+        readings += reading;
+        count++;
     }
 
-    HttpRequest(const std::string path, const char *jsonContent, bool isPost, long timeout)
-        : path(path), jsonContent(jsonContent), isPost(isPost), timeout(timeout)
+    HttpRequest Take()
     {
+        std::string head;
+
+        if (format == WireFormat::Cbor)
+        {
+            AppendCborHead(head, CborMap, 2);
+            AppendCborHead(head, CborUnsigned, 0);
+            AppendCborInteger(head, baseTimestamp);
+            AppendCborHead(head, CborUnsigned, 1);
+            AppendCborHead(head, CborArray, count);
+        }
+        else if (count > 1)
+        {
+            head = "[";
+            readings += "]";
+        }
+
+        auto bodyOffset = HeadRoom - head.size();
+
+        readings.replace(bodyOffset, head.size(), head);
+        count = 0;
+
+        return HttpRequest("device-data", std::exchange(readings, std::string()), format, true, 20, bodyOffset);
     }
 };
 
@@ -48,6 +251,12 @@ CURLcode LogErrors(CURLcode curlCode)
     return curlCode;
 }
 
+// Progress callback that aborts a transfer once the program is exiting.
+int AbortWhenExiting(void *, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    return exiting ? 1 : 0;
+}
+
 CURLcode ExecuteWithLogging(CURL *curl)
 {
     return LogErrors(curl_easy_perform(curl));
@@ -57,11 +266,7 @@ size_t CurlStoreReponseCallback(char *ptr, size_t size, size_t nmemb, std::strin
 {
     auto totalSize = size * nmemb;
 
-    for (size_t i = 0; i < totalSize; i++)
-    {
-        char responseByte = ptr[i];
-        (*response) += responseByte;
-    }
+    response->append(ptr, totalSize);
 
     return totalSize;
 }
@@ -78,226 +283,1844 @@ bool NotSuccess(long httpStatusCode)
     return httpStatusCode < 200 || httpStatusCode > 299;
 }
 
-void RefreshAccessToken()
+// Failures that may go away: transport errors (0), an access token that has to be
+// refreshed, rate limiting and server errors. Other 4xx answers reject the request
+// for good and sending it again does not help.
+bool MayBeRetried(long httpStatusCode)
+{
+    return httpStatusCode == 0 || httpStatusCode == 401 || httpStatusCode == 403 || httpStatusCode == 429 || httpStatusCode >= 500;
+}
+
+// DNS lookups and TLS sessions are shared by every handle talking to the agent, so
+// a token refresh resumes the uploader's TLS session instead of a full handshake.
+struct CurlShare
 {
-    auto curl = curl_easy_init();
+    CURLSH *share;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
 
-    if (curl)
+    CurlShare()
+        : share(curl_share_init())
     {
-        auto refreshToken = std::string(getenv("JOTTAI_REFRESH_TOKEN"));
-        auto apiHost = std::string(getenv("JOTTAI_API_HOST"));
-        auto url = apiHost + "user/tokens/access-token/";
-        std::string response = "";
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, Lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, Unlock);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
 
-        std::stringstream json;
-        json
-            << "{ "
-            << "  \"refreshToken\": \"" << refreshToken << "\""
-            << "}";
+    ~CurlShare()
+    {
+        curl_share_cleanup(share);
+    }
 
-        long httpStatusCode = 0;
-        struct curl_slist *headers = NULL;
-        auto jsonBody = json.str();
-        auto content = jsonBody.c_str();
+private:
+    static void Lock(CURL *_, curl_lock_data data, curl_lock_access access, void *self)
+    {
+        ((CurlShare *)self)->locks[data].lock();
+    }
 
-        headers = curl_slist_append(headers, "Accept: application/json");
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, "charsets: utf-8");
+    static void Unlock(CURL *_, curl_lock_data data, void *self)
+    {
+        ((CurlShare *)self)->locks[data].unlock();
+    }
+};
 
-        LogErrors(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
+CurlShare curlShare;
 
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlStoreReponseCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+struct curl_slist *AppendJsonHeaders(struct curl_slist *headers)
+{
+    headers = curl_slist_append(headers, "Accept: application/json");
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    headers = curl_slist_append(headers, "charsets: utf-8");
+
+    return headers;
+}
+
+struct curl_slist *AppendContentHeaders(struct curl_slist *headers, WireFormat format)
+{
+    if (format == WireFormat::Json)
+    {
+        return AppendJsonHeaders(headers);
+    }
+
+    headers = curl_slist_append(headers, "Accept: application/json");
+    headers = curl_slist_append(headers, (std::string("Content-Type: ") + ContentType(format)).c_str());
+
+    return headers;
+}
+
+// Minimal scanner for flat JSON documents such as the token responses. Returns the
+// position just after the colon following the "name" key, or npos.
+size_t FindJsonValue(const std::string &json, const char *name)
+{
+    auto key = std::string("\"") + name + "\"";
 
-        while (NotSuccess(httpStatusCode) && !exiting)
+    for (auto position = json.find(key); position != std::string::npos; position = json.find(key, position + 1))
+    {
+        auto value = position + key.size();
+
+        while (value < json.size() && isspace((unsigned char)json[value]))
+        {
+            value++;
+        }
+
+        if (value < json.size() && json[value] == ':')
         {
-            ExecuteWithLogging(curl);
-            LogErrors(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatusCode));
+            value++;
 
-            if (NotSuccess(httpStatusCode))
+            while (value < json.size() && isspace((unsigned char)json[value]))
             {
-                std::cerr << "Fetching access token failed with status code: " << httpStatusCode << std::endl;
-                std::cout << "Retrying after 5 seconds" << std::endl;
-                sleep(5);
+                value++;
             }
+
+            return value;
         }
+    }
 
-        std::regex accessTokenRegex(".*\"accessToken\"\\s*:\\s*\"([^\"]+)\".*");
-        std::smatch accessTokenResult;
-        std::regex_match(response, accessTokenResult, accessTokenRegex);
+    return std::string::npos;
+}
+
+std::optional<std::string> FindJsonString(const std::string &json, const char *name)
+{
+    auto position = FindJsonValue(json, name);
+
+    if (position == std::string::npos || json[position] != '"')
+    {
+        return std::nullopt;
+    }
 
-        if (accessTokenResult.size() == 2)
+    std::string value;
+
+    for (position++; position < json.size(); position++)
+    {
+        if (json[position] == '"')
         {
-            accessToken = accessTokenResult[1];
+            return value;
         }
-        else
+
+        if (json[position] == '\\' && ++position == json.size())
         {
-            std::cerr << "Could not parse bearer token" << std::endl;
+            break;
         }
 
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
+        value += json[position];
+    }
+
+    return std::nullopt;
+}
+
+std::optional<long long> FindJsonInteger(const std::string &json, const char *name)
+{
+    auto position = FindJsonValue(json, name);
+    long long value = 0;
+
+    if (position == std::string::npos)
+    {
+        return std::nullopt;
     }
-    else
+
+    auto result = std::from_chars(json.data() + position, json.data() + json.size(), value);
+
+    if (result.ec != std::errc())
     {
-        std::cerr << "failed to initialize libcurl" << std::endl;
+        return std::nullopt;
     }
+
+    return value;
 }
 
-std::tuple<long, const std::string> TryToSendToAgent(HttpRequest request)
+std::string DecodeBase64Url(const std::string &encoded)
 {
-    auto curl = curl_easy_init();
+    std::string decoded;
+    uint32_t bits = 0;
+    int bitCount = 0;
 
-    if (curl)
+    for (auto c : encoded)
     {
-        std::string response = "";
-        auto apiHost = std::string(getenv("JOTTAI_API_HOST"));
-        auto url = apiHost + request.path;
-        long httpStatusCode = 0;
-        struct curl_slist *headers = NULL;
-        auto content = request.jsonContent.c_str();
-        auto authorization = std::string("Authorization: Bearer ") + accessToken;
+        int value;
+
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            value = 62;
+        else if (c == '_' || c == '/')
+            value = 63;
+        else
+            break;
 
-        headers = curl_slist_append(headers, "Accept: application/json");
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, "charsets: utf-8");
-        headers = curl_slist_append(headers, authorization.c_str());
+        bits = (bits << 6) | value;
+        bitCount += 6;
 
-        LogErrors(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, request.timeout);
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        if (request.isPost)
+        if (bitCount >= 8)
         {
-            curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
+            bitCount -= 8;
+            decoded += (char)((bits >> bitCount) & 0xFF);
         }
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlStoreReponseCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        ExecuteWithLogging(curl);
-        LogErrors(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatusCode));
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-
-        return {httpStatusCode, response};
     }
-    else
-    {
-        std::cerr << "failed to initialize libcurl" << std::endl;
 
-        return {-1, std::string()};
-    }
+    return decoded;
 }
 
-std::tuple<long, const std::string> SendToAgent(HttpRequest request)
+// Expiry from the exp claim of a JWT, nullopt when the token is not a JWT.
+std::optional<std::chrono::system_clock::time_point> AccessTokenExpiry(const std::string &token)
 {
-    int maxTries = 5;
+    auto payloadStart = token.find('.');
+    auto payloadEnd = token.find('.', payloadStart + 1);
 
-    for (int i = 0; i < maxTries; i++)
+    if (payloadStart == std::string::npos || payloadEnd == std::string::npos)
     {
-        auto [httpStatusCode, response] = TryToSendToAgent(request);
+        return std::nullopt;
+    }
 
-        if (exiting)
-        {
-            return {httpStatusCode, response};
-        }
-        else if (httpStatusCode == 401)
-        {
-            std::cout << "Fetching a new access token" << std::endl;
-            RefreshAccessToken();
-        }
-        else if (httpStatusCode == 403)
-        {
-            std::cout << "Access denied" << std::endl;
-            std::cout << "Fetching a new access token in 10 seconds" << std::endl;
-            sleep(10);
-            RefreshAccessToken();
-        }
-        else if (NotSuccess(httpStatusCode))
-        {
-            std::cerr << "HTTP request to " << request.path << " failed with status code: " << httpStatusCode << std::endl;
-            std::cout << "Retrying after 5 seconds" << std::endl;
-            sleep(5);
-        }
-        else
-        {
-            return {httpStatusCode, response};
-        }
+    auto payload = DecodeBase64Url(token.substr(payloadStart + 1, payloadEnd - payloadStart - 1));
+    auto expiry = FindJsonInteger(payload, "exp");
+
+    if (!expiry)
+    {
+        return std::nullopt;
     }
 
-    return {-1, std::string()};
+    return std::chrono::system_clock::from_time_t((time_t)*expiry);
 }
 
-struct HttpMessagesToAgentQueue
+// Keeps an access token for the uploader. Tokens are fetched on a background thread,
+// refreshMargin before the current one expires or when a request was rejected, and
+// published atomically so that readers never wait for a refresh. With
+// JOTTAI_TOKEN_CACHE set each new token is written to that file, and a token read
+// back from it at start is used while it is valid for longer than refreshMargin.
+class AccessTokenManager
 {
-    bool active;
-    std::mutex messageQueueMutex;
-    std::mutex messageWaiterMutex;
-    std::thread thread;
-    std::condition_variable messageWaiter;
-    std::queue<HttpRequest> messages;
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
 
-    HttpMessagesToAgentQueue()
-        : active(true), thread(Worker, this)
+    AccessTokenManager()
+        : refreshMargin(std::chrono::seconds(EnvironmentOrDefault("JOTTAI_TOKEN_REFRESH_MARGIN_S", 60))),
+          cachePath(getenv("JOTTAI_TOKEN_CACHE") != nullptr ? getenv("JOTTAI_TOKEN_CACHE") : ""),
+          refreshRequested(false), stopping(false), refreshTime(TimePoint::max()), thread(Worker, this)
     {
     }
 
-    ~HttpMessagesToAgentQueue()
+    ~AccessTokenManager()
     {
-        active = false;
-        messageWaiter.notify_one();
+        {
+            std::scoped_lock lock(mutex);
+
+            stopping = true;
+        }
+
+        changed.notify_all();
         thread.join();
     }
 
-private:
-    static bool IsEmpty(HttpMessagesToAgentQueue *self)
+    std::shared_ptr<const std::string> Current() const
+    {
+        return std::atomic_load(&token);
+    }
+
+    void RequestRefresh()
     {
-        std::scoped_lock messageQueueLock(self->messageQueueMutex);
+        {
+            std::scoped_lock lock(mutex);
+
+            refreshRequested = true;
+        }
 
-        return self->messages.empty();
+        changed.notify_all();
     }
 
-    static void Worker(HttpMessagesToAgentQueue *self)
+    // Takes the cached token if it is still good, otherwise starts fetching one.
+    // Does not wait: until there is a token the uploader holds its requests.
+    void Start()
     {
-        std::unique_lock messageWaiterLock(self->messageWaiterMutex);
+        auto cached = ReadCache();
+        auto cachedExpiry = cached ? AccessTokenExpiry(*cached) : std::nullopt;
 
-        while (self->active && !exiting)
+        if (cachedExpiry && *cachedExpiry - std::chrono::system_clock::now() > refreshMargin)
         {
-            if (!IsEmpty(self))
-            {
-                std::scoped_lock messageQueueLock(self->messageQueueMutex);
+            std::scoped_lock lock(mutex);
 
-                auto message = self->messages.front();
+            std::cout << "Using the cached access token" << std::endl;
+            expiry = cachedExpiry;
+            std::atomic_store(&token, std::make_shared<const std::string>(*cached));
+            refreshTime = NextRefreshTime();
+        }
+        else
+        {
+            RequestRefresh();
+        }
 
-                SendToAgent(message);
+        changed.notify_all();
+    }
 
-                self->messages.pop();
-            }
-            else
-            {
-                self->messageWaiter.wait(messageWaiterLock);
-            }
+private:
+    // Runs on the worker without the lock held, the token is stored by the worker.
+    std::optional<std::string> Fetch()
+    {
+        auto curl = curl_easy_init();
+
+        if (!curl)
+        {
+            std::cerr << "failed to initialize libcurl" << std::endl;
+
+            return std::nullopt;
         }
-    }
-};
 
-struct Http
-{
-    HttpMessagesToAgentQueue messageQueue;
+        auto refreshToken = std::string(getenv("JOTTAI_REFRESH_TOKEN"));
+        auto apiHost = std::string(getenv("JOTTAI_API_HOST"));
+        auto url = apiHost + "user/tokens/access-token/";
+        std::string response = "";
 
-    void EnqueueHttpMessageToAgent(HttpRequest httpMesssage)
-    {
-        std::scoped_lock messageQueueLock(messageQueue.messageQueueMutex);
+        std::stringstream json;
+        json
+            << "{ "
+            << "  \"refreshToken\": \"" << refreshToken << "\""
+            << "}";
+
+        long httpStatusCode = 0;
+        struct curl_slist *headers = NULL;
+        auto jsonBody = json.str();
+        auto content = jsonBody.c_str();
 
-        messageQueue.messages.push(httpMesssage);
+        headers = AppendJsonHeaders(headers);
 
-        messageQueue.messageWaiter.notify_one();
-    }
-};
+        LogErrors(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers));
+
+        curl_easy_setopt(curl, CURLOPT_SHARE, curlShare.share);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlStoreReponseCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, AbortWhenExiting);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+        ExecuteWithLogging(curl);
+        LogErrors(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatusCode));
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+
+        if (NotSuccess(httpStatusCode))
+        {
+            std::cerr << "Fetching access token failed with status code: " << httpStatusCode << std::endl;
+
+            return std::nullopt;
+        }
+
+        auto accessToken = FindJsonString(response, "accessToken");
+
+        if (!accessToken)
+        {
+            std::cerr << "Could not parse bearer token" << std::endl;
+        }
+
+        return accessToken;
+    }
+
+    std::optional<std::string> ReadCache()
+    {
+        std::ifstream cache(cachePath);
+        std::string cached;
+
+        if (cachePath.empty() || !std::getline(cache, cached) || cached.empty())
+        {
+            return std::nullopt;
+        }
+
+        return cached;
+    }
+
+    // Replaces the cache file atomically, readable by the owner only.
+    void WriteCache(const std::string &accessToken)
+    {
+        if (cachePath.empty())
+        {
+            return;
+        }
+
+        auto temporaryPath = cachePath + ".tmp";
+        auto fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+        if (fd < 0)
+        {
+            std::cerr << "Could not write access token cache " << temporaryPath << ": " << strerror(errno) << std::endl;
+
+            return;
+        }
+
+        auto written = write(fd, accessToken.data(), accessToken.size());
+
+        close(fd);
+
+        if (written != (ssize_t)accessToken.size() || rename(temporaryPath.c_str(), cachePath.c_str()) != 0)
+        {
+            std::cerr << "Could not write access token cache " << cachePath << std::endl;
+            unlink(temporaryPath.c_str());
+        }
+    }
+
+    // Refreshes refreshMargin before expiry, or halfway through a shorter lifetime.
+    TimePoint NextRefreshTime()
+    {
+        if (!expiry)
+        {
+            return TimePoint::max();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto lifetime = std::chrono::duration_cast<std::chrono::seconds>(*expiry - std::chrono::system_clock::now());
+        auto margin = std::min<std::chrono::seconds>(refreshMargin, lifetime / 2);
+
+        return now + std::max(std::chrono::seconds(0), lifetime - margin);
+    }
+
+    static void Worker(AccessTokenManager *self)
+    {
+        std::unique_lock lock(self->mutex);
+
+        while (!self->stopping && !exiting)
+        {
+            if (!self->refreshRequested && std::chrono::steady_clock::now() < self->refreshTime)
+            {
+                if (self->refreshTime == TimePoint::max())
+                {
+                    self->changed.wait(lock);
+                }
+                else
+                {
+                    self->changed.wait_until(lock, self->refreshTime);
+                }
+
+                continue;
+            }
+
+            self->refreshRequested = false;
+
+            lock.unlock();
+
+            auto accessToken = self->Fetch();
+
+            if (accessToken)
+            {
+                self->WriteCache(*accessToken);
+            }
+
+            lock.lock();
+
+            if (accessToken)
+            {
+                self->expiry = AccessTokenExpiry(*accessToken);
+                std::atomic_store(&self->token, std::make_shared<const std::string>(*accessToken));
+                self->refreshTime = self->NextRefreshTime();
+                self->changed.notify_all();
+            }
+            else if (!exiting)
+            {
+                std::cout << "Retrying after 5 seconds" << std::endl;
+                self->refreshTime = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            }
+        }
+    }
+
+    const std::chrono::seconds refreshMargin;
+    const std::string cachePath;
+    std::shared_ptr<const std::string> token;
+    std::optional<std::chrono::system_clock::time_point> expiry;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool refreshRequested;
+    bool stopping;
+    TimePoint refreshTime;
+    std::thread thread;
+};
+
+AccessTokenManager accessTokens;
+
+// Request bodies of at least minBytes are sent gzip compressed when level is 1-9.
+// Off by default as the agent has to accept Content-Encoding: gzip.
+struct CompressionSettings
+{
+    int level;
+    size_t minBytes;
+
+    static CompressionSettings FromEnvironment()
+    {
+        return {
+            (int)std::min(9L, std::max(0L, EnvironmentOrDefault("JOTTAI_GZIP_LEVEL", 0))),
+            (size_t)std::max(0L, EnvironmentOrDefault("JOTTAI_GZIP_MIN_BYTES", 1024))};
+    }
+};
+
+// Long-lived easy handle used by the uploader. Reusing it keeps the connection to
+// the agent alive between requests. The URLs and the static headers are built once,
+// the header lists are only rebuilt when the access token changes.
+struct AgentConnection
+{
+    CURL *curl;
+    struct curl_slist *headers[2][2]; // by wire format and whether the body is gzipped
+    std::shared_ptr<const std::string> headersAccessToken;
+    const std::string apiHost;
+    std::map<std::string, std::string> urls;
+    std::string response;
+    const CompressionSettings compression;
+    z_stream gzipStream;
+    bool gzipStreamReady;
+    std::string compressedContent;
+
+    AgentConnection(const std::string &apiHost, bool http2, CompressionSettings compression)
+        : curl(curl_easy_init()), headers(), apiHost(apiHost),
+          compression(compression), gzipStream(), gzipStreamReady(false)
+    {
+        if (curl)
+        {
+            curl_easy_setopt(curl, CURLOPT_SHARE, curlShare.share);
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+            if (http2)
+            {
+                curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+                curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+            }
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlStoreReponseCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        }
+        else
+        {
+            std::cerr << "failed to initialize libcurl" << std::endl;
+        }
+    }
+
+    AgentConnection(const AgentConnection &) = delete;
+    AgentConnection &operator=(const AgentConnection &) = delete;
+
+    ~AgentConnection()
+    {
+        curl_easy_cleanup(curl);
+        FreeHeaders();
+
+        if (gzipStreamReady)
+        {
+            deflateEnd(&gzipStream);
+        }
+    }
+
+    // Sets up the transfer of request, which must stay alive until it completes.
+    void Prepare(const HttpRequest &request)
+    {
+        response.clear();
+        UpdateHeaders();
+
+        curl_easy_setopt(curl, CURLOPT_URL, Url(request.path).c_str());
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, request.timeout);
+        if (request.isPost && Compress(request.Body()))
+        {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers[(int)request.format][1]);
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)compressedContent.size());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, compressedContent.data());
+        }
+        else if (request.isPost)
+        {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers[(int)request.format][0]);
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)request.Body().size());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.Body().data());
+        }
+        else
+        {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers[(int)request.format][0]);
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        }
+    }
+
+    long StatusCode()
+    {
+        long httpStatusCode = 0;
+
+        LogErrors(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatusCode));
+
+        return httpStatusCode;
+    }
+
+    // The delay asked for by a Retry-After header of the last response, or 0.
+    std::chrono::milliseconds RetryAfter()
+    {
+        curl_off_t seconds = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &seconds);
+
+        return std::chrono::seconds(seconds);
+    }
+
+    std::chrono::milliseconds Latency()
+    {
+        curl_off_t microseconds = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &microseconds);
+
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::microseconds(microseconds));
+    }
+
+    // Compresses content into compressedContent. Returns false when the content is
+    // sent as is: compression is off, the content is small or did not get smaller.
+    bool Compress(std::string_view content)
+    {
+        if (compression.level == 0 || content.size() < compression.minBytes)
+        {
+            return false;
+        }
+
+        if (gzipStreamReady)
+        {
+            deflateReset(&gzipStream);
+        }
+        else if (deflateInit2(&gzipStream, compression.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+        {
+            gzipStreamReady = true;
+        }
+        else
+        {
+            std::cerr << "failed to initialize zlib" << std::endl;
+
+            return false;
+        }
+
+        compressedContent.resize(deflateBound(&gzipStream, content.size()));
+
+        gzipStream.next_in = (Bytef *)content.data();
+        gzipStream.avail_in = content.size();
+        gzipStream.next_out = (Bytef *)&compressedContent[0];
+        gzipStream.avail_out = compressedContent.size();
+
+        if (deflate(&gzipStream, Z_FINISH) != Z_STREAM_END)
+        {
+            return false;
+        }
+
+        compressedContent.resize(gzipStream.total_out);
+
+        return compressedContent.size() < content.size();
+    }
+
+private:
+    const std::string &Url(const std::string &path)
+    {
+        auto url = urls.find(path);
+
+        if (url == urls.end())
+        {
+            url = urls.emplace(path, apiHost + path).first;
+        }
+
+        return url->second;
+    }
+
+    void UpdateHeaders()
+    {
+        auto accessToken = accessTokens.Current();
+
+        if (headers[0][0] != NULL && headersAccessToken == accessToken)
+        {
+            return;
+        }
+
+        auto authorization = std::string("Authorization: Bearer ") + (accessToken ? *accessToken : "");
+
+        FreeHeaders();
+
+        for (auto format : {WireFormat::Json, WireFormat::Cbor})
+        {
+            for (int gzip = 0; gzip < 2; gzip++)
+            {
+                auto &list = headers[(int)format][gzip];
+
+                list = AppendContentHeaders(NULL, format);
+                list = curl_slist_append(list, authorization.c_str());
+
+                if (gzip)
+                {
+                    list = curl_slist_append(list, "Content-Encoding: gzip");
+                }
+            }
+        }
+
+        headersAccessToken = accessToken;
+    }
+
+    void FreeHeaders()
+    {
+        for (auto &formatHeaders : headers)
+        {
+            for (auto &list : formatHeaders)
+            {
+                curl_slist_free_all(list);
+                list = NULL;
+            }
+        }
+    }
+};
+
+// queueCapacity bounds the messages handed over by other threads and not yet taken
+// by the uploader, maxQueuedRequests the requests the uploader holds in its lanes.
+// Readings that do not fit in the lanes wait in a DeviceBacklog of backlog.maxBytes,
+// coalesced by backlog.policy (JOTTAI_BACKLOG_POLICY=latest or minmax) when over
+// budget. New messages are dropped instead of blocking the caller.
+struct UploadSettings
+{
+    size_t maxInFlight;
+    bool http2;
+    size_t queueCapacity;
+    size_t maxQueuedRequests;
+    CompressionSettings compression;
+    BacklogSettings backlog;
+
+    static UploadSettings FromEnvironment()
+    {
+        auto policy = getenv("JOTTAI_BACKLOG_POLICY");
+
+        return {
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_MAX_IN_FLIGHT", 4)),
+            EnvironmentOrDefault("JOTTAI_HTTP2", 0) != 0,
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_QUEUE_CAPACITY", 1024)),
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_MAX_QUEUED_REQUESTS", 256)),
+            CompressionSettings::FromEnvironment(),
+            {(size_t)std::max(4096L, EnvironmentOrDefault("JOTTAI_BACKLOG_MAX_BYTES", 1024 * 1024)),
+             std::chrono::seconds(std::max(0L, EnvironmentOrDefault("JOTTAI_BACKLOG_MAX_AGE_S", 24 * 60 * 60))),
+             policy != nullptr && strcmp(policy, "latest") == 0 ? CoalescePolicy::Latest : CoalescePolicy::MinMax}};
+    }
+};
+
+// With JOTTAI_OUTBOX_DIR set, requests that run out of retries or do not fit in
+// the uploader's lanes are stored on disk and sent again, at most drainPerSecond
+// requests a second, once the agent is reachable.
+struct OutboxDrainSettings
+{
+    OutboxSettings outbox;
+    long drainPerSecond;
+
+    static OutboxDrainSettings FromEnvironment()
+    {
+        auto directory = getenv("JOTTAI_OUTBOX_DIR");
+
+        return {
+            {directory != nullptr ? directory : "",
+             (size_t)std::max(4096L, EnvironmentOrDefault("JOTTAI_OUTBOX_SEGMENT_BYTES", 1024 * 1024)),
+             (size_t)std::max(4096L, EnvironmentOrDefault("JOTTAI_OUTBOX_MAX_BYTES", 64 * 1024 * 1024)),
+             (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_OUTBOX_SYNC_BYTES", 64 * 1024)),
+             std::chrono::milliseconds(EnvironmentOrDefault("JOTTAI_OUTBOX_SYNC_MS", 1000))},
+            std::max(1L, EnvironmentOrDefault("JOTTAI_OUTBOX_DRAIN_PER_SECOND", 20))};
+    }
+};
+
+// Stores the request in the outbox, returns false if it had to be dropped. The body
+// is stored as sent, so a replayed reading keeps its idempotency key. The ordering
+// key is stored in the Tarts ID format, as the device ID of device data.
+bool AppendToOutbox(Outbox &outbox, uint32_t orderingKey, const HttpRequest &request)
+{
+    uint8_t flags = (request.isPost ? 1 : 0) | (request.format == WireFormat::Cbor ? 2 : 0);
+
+    return outbox.IsOpen() && outbox.Append(IntToBase36(orderingKey).value, request.path, request.Body(), flags, request.timeout);
+}
+
+uint32_t OrderingKeyFromOutbox(const OutboxRecord &record)
+{
+    return Base36ArrayToInt(record.orderingKey.c_str());
+}
+
+HttpRequest RequestFromOutbox(OutboxRecord &record)
+{
+    return HttpRequest(std::move(record.path), std::move(record.content), record.flags & 2 ? WireFormat::Cbor : WireFormat::Json, record.flags & 1, record.timeout);
+}
+
+// An agent the uploader sends to. The primary destination is JOTTAI_API_HOST, the
+// agents listed in JOTTAI_MIRROR_HOSTS, separated by commas, get a copy of every
+// reading, for example a staging agent or a local historian. Each destination has
+// an uploader of its own, with its own queue, connections, batches, retries, circuit
+// breaker and outbox subdirectory, so a slow mirror does not hold back the others.
+// All destinations are sent the same access token, only the primary's 401 and 403
+// answers make the uploader fetch a new one.
+struct UploadDestination
+{
+    std::string apiHost;
+    std::string outboxName; // subdirectory of JOTTAI_OUTBOX_DIR, empty for the primary
+    bool primary;
+
+    static std::vector<UploadDestination> FromEnvironment()
+    {
+        auto apiHost = getenv("JOTTAI_API_HOST");
+        auto mirrorHosts = getenv("JOTTAI_MIRROR_HOSTS");
+        std::vector<UploadDestination> destinations = {{apiHost != nullptr ? apiHost : "", std::string(), true}};
+        std::stringstream mirrors(mirrorHosts != nullptr ? mirrorHosts : "");
+        std::string mirror;
+
+        while (std::getline(mirrors, mirror, ','))
+        {
+            if (!mirror.empty())
+            {
+                destinations.push_back({mirror, "mirror-" + std::to_string(destinations.size()), false});
+            }
+        }
+
+        return destinations;
+    }
+};
+
+// A message on its way from the enqueuing thread to the uploader worker: either a
+// complete request or a sensor sample still to be serialized and batched.
+struct UploadItem
+{
+    std::optional<SensorSample> sample;
+    std::optional<HttpRequest> request;
+};
+
+// Failed requests are retried after an exponentially growing delay, starting at
+// initialDelay and capped at maxDelay. maxTries of 0 retries until the request
+// gets through.
+struct RetrySettings
+{
+    std::chrono::milliseconds initialDelay;
+    std::chrono::milliseconds maxDelay;
+    int maxTries;
+
+    static RetrySettings FromEnvironment()
+    {
+        return {
+            std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_RETRY_INITIAL_DELAY_MS", 1000))),
+            std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_RETRY_MAX_DELAY_MS", 5 * 60 * 1000))),
+            (int)std::max(0L, EnvironmentOrDefault("JOTTAI_RETRY_MAX_TRIES", 5))};
+    }
+};
+
+// Alarm readings (see DeviceDataPriority) skip batching and the bulk lanes: they
+// are sent one at a time on a connection of their own, ahead of any backlog, and
+// are retried on a much shorter schedule. JOTTAI_ALARM_LANE=0 sends them as
+// routine telemetry.
+struct AlarmSettings
+{
+    bool reservedLane;
+    size_t queueCapacity;
+    RetrySettings retry;
+
+    static AlarmSettings FromEnvironment()
+    {
+        auto retry = RetrySettings::FromEnvironment();
+
+        retry.initialDelay = std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_ALARM_RETRY_INITIAL_DELAY_MS", 250)));
+        retry.maxDelay = std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_ALARM_RETRY_MAX_DELAY_MS", 2000)));
+
+        return {
+            EnvironmentOrDefault("JOTTAI_ALARM_LANE", 1) != 0,
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_ALARM_QUEUE_CAPACITY", 64)),
+            retry};
+    }
+};
+
+// Adapts the load put on the agent to what it can absorb. Successful requests
+// answered within latencyTarget let the number of concurrent requests and the
+// readings per batch grow additively; overload (429, 5xx, transport errors or a
+// slow answer) halves them, at most once per latencyTarget. After failureThreshold
+// overloads in a row, or when the agent asks for it with Retry-After, the circuit
+// opens and nothing is sent for openDelay, doubled up to maxOpenDelay while the
+// single probe request sent after each pause keeps failing.
+struct FlowControlSettings
+{
+    int failureThreshold;
+    std::chrono::milliseconds openDelay;
+    std::chrono::milliseconds maxOpenDelay;
+    std::chrono::milliseconds latencyTarget;
+
+    static FlowControlSettings FromEnvironment()
+    {
+        return {
+            (int)std::max(1L, EnvironmentOrDefault("JOTTAI_BREAKER_FAILURES", 5)),
+            std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_BREAKER_OPEN_MS", 10000))),
+            std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_BREAKER_MAX_OPEN_MS", 5 * 60 * 1000))),
+            std::chrono::milliseconds(std::max(1L, EnvironmentOrDefault("JOTTAI_LATENCY_TARGET_MS", 2000)))};
+    }
+};
+
+class FlowControl
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    FlowControl(FlowControlSettings settings, size_t maxConcurrency, size_t maxBatchReadings)
+        : settings(settings),
+          maxConcurrency(maxConcurrency),
+          maxBatchReadings(maxBatchReadings),
+          concurrency(maxConcurrency),
+          batchReadings(maxBatchReadings),
+          state(Closed),
+          consecutiveFailures(0),
+          openDelay(settings.openDelay),
+          random(std::random_device()())
+    {
+    }
+
+    // Whether one more request may be started with inFlight requests running.
+    bool MayStart(TimePoint now, size_t inFlight)
+    {
+        if (state == Open && now >= openUntil)
+        {
+            state = HalfOpen;
+            probing = false;
+        }
+
+        if (state == Open || (state == HalfOpen && probing))
+        {
+            return false;
+        }
+
+        probing = state == HalfOpen;
+
+        return inFlight < (size_t)concurrency;
+    }
+
+    // When the circuit may be probed again, TimePoint::max() unless it is open.
+    TimePoint ReopenTime() const
+    {
+        return state == Open ? openUntil : TimePoint::max();
+    }
+
+    bool IsClosed() const
+    {
+        return state == Closed;
+    }
+
+    size_t BatchReadings() const
+    {
+        return (size_t)batchReadings;
+    }
+
+    void OnSuccess(TimePoint now, std::chrono::milliseconds latency)
+    {
+        OnAnswer();
+
+        if (latency > settings.latencyTarget)
+        {
+            Decrease(now);
+
+            return;
+        }
+
+        concurrency = std::min((double)maxConcurrency, concurrency + 1 / concurrency);
+        batchReadings = std::min((double)maxBatchReadings, batchReadings + std::max(1.0, maxBatchReadings / 20.0) / concurrency);
+    }
+
+    // The agent answered but not successfully, for reasons other than overload.
+    void OnAnswer()
+    {
+        consecutiveFailures = 0;
+
+        if (state == HalfOpen)
+        {
+            std::cout << "Agent is answering again, resuming uploads" << std::endl;
+            state = Closed;
+            openDelay = settings.openDelay;
+        }
+    }
+
+    void OnOverload(TimePoint now, std::chrono::milliseconds retryAfter)
+    {
+        consecutiveFailures++;
+        Decrease(now);
+
+        if (state == Open)
+        {
+            // A request started before the circuit opened.
+            openUntil = std::max(openUntil, now + retryAfter);
+        }
+        else if (state == HalfOpen || consecutiveFailures >= settings.failureThreshold || retryAfter.count() > 0)
+        {
+            std::uniform_int_distribution<long> jitter(0, openDelay.count() / 2);
+            auto delay = std::max(openDelay - std::chrono::milliseconds(jitter(random)), retryAfter);
+
+            std::cerr << "Agent overloaded or unreachable, pausing uploads for " << delay.count() << " ms" << std::endl;
+            state = Open;
+            openUntil = now + delay;
+            openDelay = std::min(openDelay * 2, settings.maxOpenDelay);
+        }
+    }
+
+private:
+    enum State
+    {
+        Closed,
+        Open,
+        HalfOpen
+    };
+
+    const FlowControlSettings settings;
+    const size_t maxConcurrency;
+    const size_t maxBatchReadings;
+    double concurrency;
+    double batchReadings;
+    State state;
+    bool probing;
+    int consecutiveFailures;
+    std::chrono::milliseconds openDelay;
+    TimePoint openUntil;
+    TimePoint lastDecreaseTime;
+    std::minstd_rand random;
+
+    void Decrease(TimePoint now)
+    {
+        if (now - lastDecreaseTime < settings.latencyTarget)
+        {
+            return;
+        }
+
+        lastDecreaseTime = now;
+        concurrency = std::max(1.0, concurrency / 2);
+        batchReadings = std::max(1.0, batchReadings / 2);
+    }
+};
+
+struct PendingRequest
+{
+    uint32_t orderingKey; // the device ID of device data, a hash of the path of other requests
+    HttpRequest request;
+    int attempts;
+    uint64_t outboxSegment; // 0 unless the request was read back from the outbox
+};
+
+// Each lane sends its messages in order with at most one request in flight. Messages
+// with the same ordering key (the device for device data) always use the same lane,
+// so the uploader keeps up to maxInFlight requests going without reordering a device.
+// A request waiting for a retry steps out of its lane and goes to the front again
+// once it is due, so only a failed request itself can end up out of order.
+struct UploadLane
+{
+    AgentConnection connection;
+    std::deque<PendingRequest> messages;
+    DeviceDataBatch batch;
+    std::optional<PendingRequest> inFlight;
+    const RetrySettings &retrySettings;
+
+    UploadLane(const std::string &apiHost, bool http2, CompressionSettings compression, WireFormat format, RequestBufferPool &bufferPool, const RetrySettings &retrySettings)
+        : connection(apiHost, http2, compression), retrySettings(retrySettings)
+    {
+        batch.format = format;
+        batch.pool = &bufferPool;
+    }
+};
+
+// Only the worker thread touches the lanes. Other threads hand messages over through
+// a lock-free queue and never wait for the worker or the network.
+struct HttpMessagesToAgentQueue
+{
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    bool active;
+    const UploadDestination destination;
+    UploadSettings settings;
+    DeviceDataBatchSettings batchSettings;
+    RetrySettings retrySettings;
+    AlarmSettings alarmSettings;
+    OutboxDrainSettings outboxSettings;
+    FlowControl flowControl;
+    DeviceDataBatchSettings batchLimits; // batchSettings as adapted by flowControl
+    RequestBufferPool bufferPool;
+    Outbox outbox;
+    double drainCredit;
+    TimePoint lastDrainTime;
+    BoundedMpscQueue<UploadItem> incoming;
+    BoundedMpscQueue<UploadItem> incomingAlarms;
+    DeviceBacklog backlog;
+    DeviceDataSerializer serializer;
+    std::atomic<size_t> droppedMessages;
+    size_t reportedDroppedMessages;
+    size_t rejectedRequests; // failed with a status that retrying does not fix
+    size_t queuedRequests;
+    std::multimap<TimePoint, std::pair<UploadLane *, PendingRequest>> retries;
+    std::minstd_rand random;
+    CURLM *multi;
+    CURL *warmUp;           // connection opened ahead of the first upload, until it is done
+    std::vector<std::unique_ptr<UploadLane>> lanes;
+    std::unique_ptr<UploadLane> alarmLane;
+    size_t nextLane;        // where StartReadyLanes begins, so no lane is always last
+    size_t inFlightRequests; // on the bulk lanes
+    std::atomic<bool> draining;
+    TimePoint drainDeadline; // written before draining is set
+    bool spillAll;           // Queue stores every request in the outbox
+    std::thread thread;
+
+    explicit HttpMessagesToAgentQueue(UploadDestination destination)
+        : active(true),
+          destination(std::move(destination)),
+          settings(UploadSettings::FromEnvironment()),
+          batchSettings(DeviceDataBatchSettings::FromEnvironment()),
+          retrySettings(RetrySettings::FromEnvironment()),
+          alarmSettings(AlarmSettings::FromEnvironment()),
+          outboxSettings(OutboxDrainSettings::FromEnvironment()),
+          flowControl(FlowControlSettings::FromEnvironment(), settings.maxInFlight, batchSettings.maxReadings),
+          batchLimits(batchSettings),
+          bufferPool(settings.maxInFlight * 2 + 2, batchSettings.maxBytes + DeviceDataBatch::HeadRoom + 1024),
+          drainCredit(0),
+          lastDrainTime(std::chrono::steady_clock::now()),
+          incoming(settings.queueCapacity),
+          incomingAlarms(alarmSettings.queueCapacity),
+          backlog(settings.backlog),
+          droppedMessages(0),
+          reportedDroppedMessages(0),
+          rejectedRequests(0),
+          queuedRequests(0),
+          random(std::random_device()()),
+          multi(curl_multi_init()),
+          warmUp(nullptr),
+          nextLane(0),
+          inFlightRequests(0),
+          draining(false),
+          spillAll(false)
+    {
+        if (settings.http2)
+        {
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        }
+
+        for (size_t i = 0; i < settings.maxInFlight; i++)
+        {
+            lanes.push_back(std::make_unique<UploadLane>(this->destination.apiHost, settings.http2, settings.compression, batchSettings.format, bufferPool, retrySettings));
+        }
+
+        if (alarmSettings.reservedLane)
+        {
+            alarmLane = std::make_unique<UploadLane>(this->destination.apiHost, settings.http2, settings.compression, batchSettings.format, bufferPool, alarmSettings.retry);
+        }
+
+        if (!outboxSettings.outbox.directory.empty() && !this->destination.outboxName.empty())
+        {
+            outboxSettings.outbox.directory += "/" + this->destination.outboxName;
+        }
+
+        if (!outboxSettings.outbox.directory.empty() && !outbox.Open(outboxSettings.outbox))
+        {
+            std::cerr << "Continuing without an outbox" << std::endl;
+        }
+
+        thread = std::thread(Worker, this);
+    }
+
+    ~HttpMessagesToAgentQueue()
+    {
+        active = false;
+        curl_multi_wakeup(multi);
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+        lanes.clear();
+        alarmLane.reset();
+        curl_multi_cleanup(multi);
+    }
+
+    // Has the worker send what it holds, batches that are still lingering included,
+    // without retrying failures, and store whatever is not delivered by deadline in
+    // the outbox. Requests waiting for a retry are stored right away rather than
+    // after their backoff. Nothing should be enqueued after this. EndDrain waits for it.
+    void BeginDrain(TimePoint deadline)
+    {
+        drainDeadline = deadline;
+        draining = true;
+        curl_multi_wakeup(multi);
+    }
+
+    void EndDrain()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+    bool Enqueue(UploadItem item, DeviceDataPriority priority = DeviceDataPriority::Telemetry)
+    {
+        auto &queue = priority == DeviceDataPriority::Alarm && alarmLane ? incomingAlarms : incoming;
+
+        if (!queue.TryPush(std::move(item)))
+        {
+            droppedMessages++;
+
+            return false;
+        }
+
+        curl_multi_wakeup(multi);
+
+        return true;
+    }
+
+private:
+    UploadLane &LaneFor(uint32_t orderingKey)
+    {
+        return *lanes[orderingKey % lanes.size()];
+    }
+
+    bool Spill(uint32_t orderingKey, const HttpRequest &request)
+    {
+        return AppendToOutbox(outbox, orderingKey, request);
+    }
+
+    void Queue(uint32_t orderingKey, HttpRequest request, uint64_t outboxSegment = 0)
+    {
+        if ((spillAll || queuedRequests >= settings.maxQueuedRequests) && Spill(orderingKey, request))
+        {
+            bufferPool.Return(std::move(request.content));
+
+            return;
+        }
+
+        LaneFor(orderingKey).messages.push_back({orderingKey, std::move(request), 0, outboxSegment});
+        queuedRequests++;
+    }
+
+    void TakeBatch(UploadLane &lane)
+    {
+        auto orderingKey = lane.batch.orderingKey;
+
+        Queue(orderingKey, lane.batch.Take());
+    }
+
+    // A request for the sample alone, for when it does not go through a lane's batch.
+    HttpRequest SingleReading(const SensorSample &sample)
+    {
+        DeviceDataBatch single;
+
+        single.format = batchSettings.format;
+        single.pool = &bufferPool;
+        single.Add(sample.deviceId, serializer.Serialize(batchSettings.format, sample), sample.timestamp);
+
+        return single.Take();
+    }
+
+    void AddReading(const SensorSample &sample)
+    {
+        auto orderingKey = sample.deviceId;
+        auto &reading = serializer.Serialize(batchSettings.format, sample);
+        auto timestamp = sample.timestamp;
+        auto &lane = LaneFor(orderingKey);
+
+        if (lane.batch.WouldOverflow(reading, batchLimits))
+        {
+            TakeBatch(lane);
+        }
+
+        lane.batch.Add(orderingKey, reading, timestamp);
+
+        if (lane.batch.IsFull(batchLimits))
+        {
+            TakeBatch(lane);
+        }
+    }
+
+    // Moves handed over messages to their lanes. Readings go through the backlog,
+    // which holds those that do not fit in the lanes and sheds or, with an outbox,
+    // spills the oldest when over budget. Alarms skip the backlog.
+    void TakeIncoming()
+    {
+        while (auto alarm = incomingAlarms.TryPop())
+        {
+            alarmLane->messages.push_back({alarm->sample->deviceId, SingleReading(*alarm->sample), 0, 0});
+            queuedRequests++;
+        }
+
+        while (auto item = incoming.TryPop())
+        {
+            if (item->request)
+            {
+                auto orderingKey = (uint32_t)std::hash<std::string>()(item->request->path);
+
+                Queue(orderingKey, std::move(*item->request));
+            }
+            else
+            {
+                backlog.Add(*item->sample);
+            }
+        }
+
+        size_t shed = backlog.TakeShedReadings();
+
+        while (backlog.IsOverBudget())
+        {
+            auto oldest = backlog.EvictOldest();
+
+            if (!Spill(oldest->deviceId, SingleReading(*oldest)))
+            {
+                shed++;
+            }
+        }
+
+        while (spillAll || queuedRequests < settings.maxQueuedRequests)
+        {
+            auto next = backlog.Take(time(NULL));
+
+            if (!next)
+            {
+                break;
+            }
+
+            AddReading(*next);
+        }
+
+        shed += backlog.TakeShedReadings();
+
+        if (shed > 0)
+        {
+            std::cerr << "Upload backlog over budget or stale, shed " << shed << " readings" << std::endl;
+        }
+
+        size_t dropped = droppedMessages;
+
+        if (dropped != reportedDroppedMessages)
+        {
+            std::cerr << "Upload queue of " << destination.apiHost << " full, dropped " << dropped - reportedDroppedMessages << " messages" << std::endl;
+            reportedDroppedMessages = dropped;
+        }
+    }
+
+    // Puts retries that are due back to the front of their lanes, earliest first.
+    TimePoint RequeueDueRetries(TimePoint now)
+    {
+        auto due = retries.upper_bound(now);
+
+        for (auto retry = std::make_reverse_iterator(due); retry != retries.rend(); ++retry)
+        {
+            auto &[lane, pending] = retry->second;
+
+            lane->messages.push_front(std::move(pending));
+        }
+
+        retries.erase(retries.begin(), due);
+
+        return retries.empty() ? TimePoint::max() : retries.begin()->first;
+    }
+
+    // Replays stored requests while the agent is reachable and the lanes have room.
+    // Returns when the next request may be read back.
+    TimePoint DrainOutbox(TimePoint now)
+    {
+        auto elapsed = std::chrono::duration<double>(now - lastDrainTime).count();
+        auto rate = outboxSettings.drainPerSecond;
+
+        lastDrainTime = now;
+        drainCredit = std::min((double)rate, drainCredit + elapsed * rate);
+
+        if (!outbox.IsOpen() || !flowControl.IsClosed() || draining)
+        {
+            return TimePoint::max();
+        }
+
+        while (drainCredit >= 1 && queuedRequests < settings.maxQueuedRequests)
+        {
+            auto record = outbox.Next();
+
+            if (!record)
+            {
+                return TimePoint::max();
+            }
+
+            Queue(OrderingKeyFromOutbox(*record), RequestFromOutbox(*record), record->segment);
+            drainCredit--;
+        }
+
+        return now + std::chrono::milliseconds(1000 / rate + 1);
+    }
+
+    // Starts the next request of idle lanes, as many as flow control allows, and
+    // returns when the worker has to look at the lanes again for lingering batches,
+    // retries and the circuit breaker. The alarm lane does not count against the
+    // concurrency limit but waits while the circuit is open. Nothing is started
+    // before the first access token arrives, readings wait in the lanes and backlog.
+    TimePoint StartReadyLanes()
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto wakeUpTime = std::min({now + std::chrono::seconds(1), RequeueDueRetries(now), DrainOutbox(now), outbox.SyncIfDue(now), flowControl.ReopenTime()});
+        bool authorized = accessTokens.Current() != nullptr;
+
+        batchLimits.maxReadings = flowControl.BatchReadings();
+
+        if (draining)
+        {
+            wakeUpTime = std::min(wakeUpTime, drainDeadline);
+        }
+
+        if (authorized && alarmLane && !alarmLane->inFlight && !alarmLane->messages.empty() && flowControl.MayStart(now, 0))
+        {
+            Start(*alarmLane);
+        }
+
+        for (size_t i = 0; i < lanes.size(); i++)
+        {
+            auto &lane = lanes[(nextLane + i) % lanes.size()];
+
+            if (!lane->batch.IsEmpty())
+            {
+                auto flushTime = lane->batch.FlushTime(batchLimits);
+
+                if (flushTime <= now || draining)
+                {
+                    TakeBatch(*lane);
+                }
+                else
+                {
+                    wakeUpTime = std::min(wakeUpTime, flushTime);
+                }
+            }
+
+            if (authorized && !lane->inFlight && !lane->messages.empty() && flowControl.MayStart(now, inFlightRequests))
+            {
+                Start(*lane);
+                inFlightRequests++;
+            }
+        }
+
+        nextLane++;
+
+        return wakeUpTime;
+    }
+
+    void Start(UploadLane &lane)
+    {
+        lane.inFlight.emplace(std::move(lane.messages.front()));
+        lane.messages.pop_front();
+        lane.connection.Prepare(lane.inFlight->request);
+        curl_easy_setopt(lane.connection.curl, CURLOPT_PRIVATE, &lane);
+
+        curl_multi_add_handle(multi, lane.connection.curl);
+    }
+
+    // Exponential backoff with equal jitter: half of the delay is fixed and half
+    // random, so gateways recovering from the same outage do not retry in step.
+    std::chrono::milliseconds Backoff(const RetrySettings &retry, int attempts)
+    {
+        auto delay = retry.initialDelay;
+
+        for (int i = 1; i < attempts && delay < retry.maxDelay; i++)
+        {
+            delay *= 2;
+        }
+
+        delay = std::min(delay, retry.maxDelay);
+
+        std::uniform_int_distribution<long> jitter(0, delay.count() / 2);
+
+        return delay - std::chrono::milliseconds(jitter(random));
+    }
+
+    std::chrono::milliseconds RetryDelay(UploadLane &lane, const PendingRequest &pending, long httpStatusCode)
+    {
+        auto backoff = std::max(Backoff(lane.retrySettings, pending.attempts), lane.connection.RetryAfter());
+
+        if (httpStatusCode == 401 && destination.primary)
+        {
+            std::cout << "Fetching a new access token" << std::endl;
+            accessTokens.RequestRefresh();
+
+            return backoff;
+        }
+        else if (httpStatusCode == 403 && destination.primary)
+        {
+            backoff = std::max(backoff, std::chrono::milliseconds(10000));
+
+            std::cout << "Access denied" << std::endl;
+            std::cout << "Fetching a new access token, retrying after " << backoff.count() << " ms" << std::endl;
+            accessTokens.RequestRefresh();
+
+            return backoff;
+        }
+        else
+        {
+            std::cerr << "HTTP request to " << destination.apiHost << pending.request.path << " failed with status code: " << httpStatusCode << std::endl;
+            std::cout << "Retrying after " << backoff.count() << " ms" << std::endl;
+
+            return backoff;
+        }
+    }
+
+    // 429, 5xx and transport errors mean the agent cannot keep up or is down.
+    void UpdateFlowControl(UploadLane &lane, long httpStatusCode)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        if (!NotSuccess(httpStatusCode))
+        {
+            flowControl.OnSuccess(now, lane.connection.Latency());
+        }
+        else if (httpStatusCode == 0 || httpStatusCode == 429 || httpStatusCode >= 500)
+        {
+            flowControl.OnOverload(now, httpStatusCode == 0 ? std::chrono::milliseconds(0) : lane.connection.RetryAfter());
+        }
+        else
+        {
+            flowControl.OnAnswer();
+        }
+    }
+
+    void Complete(UploadLane &lane, long httpStatusCode)
+    {
+        auto pending = std::move(*lane.inFlight);
+
+        lane.inFlight.reset();
+        UpdateFlowControl(lane, httpStatusCode);
+
+        if (&lane != alarmLane.get())
+        {
+            inFlightRequests--;
+        }
+
+        // A request read back from the outbox stays there until it was delivered,
+        // rejected for good or stored again
+        bool done = !NotSuccess(httpStatusCode);
+
+        if (NotSuccess(httpStatusCode) && !exiting)
+        {
+            pending.attempts++;
+
+            if (!draining && (lane.retrySettings.maxTries == 0 || pending.attempts < lane.retrySettings.maxTries))
+            {
+                auto retryTime = std::chrono::steady_clock::now() + RetryDelay(lane, pending, httpStatusCode);
+
+                retries.emplace(retryTime, std::make_pair(&lane, std::move(pending)));
+
+                return;
+            }
+
+            if (!MayBeRetried(httpStatusCode))
+            {
+                rejectedRequests++;
+                done = true;
+                std::cerr << "HTTP request to " << pending.request.path << " rejected with status code " << httpStatusCode << " and dropped after "
+                          << pending.attempts << " tries, " << rejectedRequests << " rejected so far" << std::endl;
+            }
+            else if (Spill(pending.orderingKey, pending.request))
+            {
+                done = true;
+                std::cerr << "HTTP request to " << pending.request.path << " stored in the outbox after " << pending.attempts << " tries" << std::endl;
+            }
+            else
+            {
+                std::cerr << "HTTP request to " << pending.request.path << " dropped after " << pending.attempts << " tries" << std::endl;
+            }
+        }
+
+        if (pending.outboxSegment != 0 && done)
+        {
+            outbox.Done(pending.outboxSegment);
+        }
+
+        bufferPool.Return(std::move(pending.request.content));
+        queuedRequests--;
+    }
+
+    // Returns true when a lane became idle and can start its next request.
+    bool CompleteTransfers()
+    {
+        int messagesInQueue = 0;
+        bool completed = false;
+
+        while (auto message = curl_multi_info_read(multi, &messagesInQueue))
+        {
+            if (message->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            UploadLane *lane = nullptr;
+            auto curl = message->easy_handle;
+
+            if (curl == warmUp)
+            {
+                EndWarmUp();
+                continue;
+            }
+
+            LogErrors(message->data.result);
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &lane);
+            curl_multi_remove_handle(multi, curl);
+
+            Complete(*lane, message->data.result == CURLE_OK ? lane->connection.StatusCode() : 0);
+            completed = true;
+        }
+
+        return completed;
+    }
+
+    // Resolves the agent's address and does a TLS handshake while the gateway is
+    // still starting up, so the first upload finds both in the shared cache. The
+    // handshake runs on the multi handle next to the uploads, which do not wait for
+    // it. Failures are left for the first upload to report.
+    void StartWarmUp()
+    {
+        auto curl = curl_easy_init();
+
+        if (!curl || destination.apiHost.empty())
+        {
+            curl_easy_cleanup(curl);
+
+            return;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_SHARE, curlShare.share);
+        curl_easy_setopt(curl, CURLOPT_URL, destination.apiHost.c_str());
+        curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_multi_add_handle(multi, curl);
+        warmUp = curl;
+    }
+
+    void EndWarmUp()
+    {
+        if (warmUp != nullptr)
+        {
+            curl_multi_remove_handle(multi, warmUp);
+            curl_easy_cleanup(warmUp);
+            warmUp = nullptr;
+        }
+    }
+
+    // While draining: true once everything has been sent, or when nothing more
+    // can be sent before the deadline.
+    bool IsDrained()
+    {
+        if (!draining)
+        {
+            return false;
+        }
+
+        if (!retries.empty())
+        {
+            SpillRetries();
+        }
+
+        auto reopenTime = flowControl.ReopenTime();
+
+        if (std::chrono::steady_clock::now() >= drainDeadline || !accessTokens.Current() || (reopenTime != TimePoint::max() && reopenTime >= drainDeadline))
+        {
+            return true;
+        }
+
+        TakeIncoming();
+
+        if (queuedRequests > 0 || !backlog.IsEmpty())
+        {
+            return false;
+        }
+
+        for (auto &lane : lanes)
+        {
+            if (!lane->batch.IsEmpty())
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Returns 1 if the request is lost. Requests read back from the outbox are
+    // still stored there.
+    size_t SpillPending(const PendingRequest &pending)
+    {
+        return pending.outboxSegment == 0 && !Spill(pending.orderingKey, pending.request) ? 1 : 0;
+    }
+
+    // Stores the requests waiting for a retry in the outbox once a drain begins, so
+    // that the drain does not wait out their backoff.
+    void SpillRetries()
+    {
+        size_t lost = 0;
+
+        for (auto &retry : retries)
+        {
+            auto &pending = retry.second.second;
+
+            lost += SpillPending(pending);
+            bufferPool.Return(std::move(pending.request.content));
+            queuedRequests--;
+        }
+
+        retries.clear();
+
+        if (lost > 0)
+        {
+            std::cerr << "Shutting down, " << lost << " requests to " << destination.apiHost << " waiting for a retry could not be stored" << std::endl;
+        }
+    }
+
+    size_t SpillLane(UploadLane &lane)
+    {
+        size_t lost = 0;
+
+        if (lane.inFlight)
+        {
+            curl_multi_remove_handle(multi, lane.connection.curl);
+            lost += SpillPending(*lane.inFlight);
+            lane.inFlight.reset();
+        }
+
+        for (auto &pending : lane.messages)
+        {
+            lost += SpillPending(pending);
+        }
+
+        lane.messages.clear();
+
+        return lost;
+    }
+
+    // Stores everything still held at the end of a drain in the outbox, oldest
+    // first, for the next start to send. Aborted transfers may have reached the
+    // agent, which drops the copies by their idempotency keys.
+    void SpillRemaining()
+    {
+        size_t lost = 0;
+
+        spillAll = true;
+
+        for (auto &retry : retries)
+        {
+            lost += SpillPending(retry.second.second);
+        }
+
+        retries.clear();
+
+        for (auto &lane : lanes)
+        {
+            lost += SpillLane(*lane);
+        }
+
+        TakeIncoming();
+
+        for (auto &lane : lanes)
+        {
+            if (!lane->batch.IsEmpty())
+            {
+                TakeBatch(*lane);
+            }
+
+            lost += SpillLane(*lane);
+        }
+
+        if (alarmLane)
+        {
+            lost += SpillLane(*alarmLane);
+        }
+
+        if (outbox.IsOpen() && !outbox.Sync())
+        {
+            std::cerr << "Shutting down, the outbox of " << destination.apiHost << " could not be written, its buffered requests are lost" << std::endl;
+        }
+
+        if (lost > 0)
+        {
+            std::cerr << "Shutting down, " << lost << " requests to " << destination.apiHost << " could not be stored" << std::endl;
+        }
+    }
+
+    static void Worker(HttpMessagesToAgentQueue *self)
+    {
+        int runningTransfers = 0;
+
+        self->StartWarmUp();
+
+        while (self->active && !exiting && !self->IsDrained())
+        {
+            self->TakeIncoming();
+
+            auto wakeUpTime = self->StartReadyLanes();
+
+            curl_multi_perform(self->multi, &runningTransfers);
+
+            if (self->CompleteTransfers())
+            {
+                continue;
+            }
+
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wakeUpTime - std::chrono::steady_clock::now());
+
+            curl_multi_poll(self->multi, NULL, 0, (int)std::max(0L, (long)timeout.count()), NULL);
+        }
+
+        if (self->draining)
+        {
+            self->SpillRemaining();
+        }
+
+        self->EndWarmUp();
+
+        for (auto &lane : self->lanes)
+        {
+            if (lane->inFlight)
+            {
+                curl_multi_remove_handle(self->multi, lane->connection.curl);
+            }
+        }
+
+        if (self->alarmLane && self->alarmLane->inFlight)
+        {
+            curl_multi_remove_handle(self->multi, self->alarmLane->connection.curl);
+        }
+    }
+};
+
+// Fans readings out to the uploaders of all destinations. Other requests only go
+// to the primary destination.
+struct Http : DeviceDataSink
+{
+    std::vector<std::unique_ptr<HttpMessagesToAgentQueue>> messageQueues;
+
+    Http()
+    {
+        for (auto &destination : UploadDestination::FromEnvironment())
+        {
+            messageQueues.push_back(std::make_unique<HttpMessagesToAgentQueue>(destination));
+        }
+    }
+
+    // Returns false, without waiting, when the upload queue is full.
+    bool EnqueueHttpMessageToAgent(HttpRequest httpMesssage)
+    {
+        return messageQueues.front()->Enqueue({std::nullopt, std::move(httpMesssage)});
+    }
+
+    // Returns false when the primary destination's queue is full, mirrors count
+    // and report their own drops.
+    bool EnqueueDeviceData(const SensorSample &sample) override
+    {
+        bool queued = messageQueues.front()->Enqueue({sample, std::nullopt}, sample.priority);
+
+        for (size_t i = 1; i < messageQueues.size(); i++)
+        {
+            messageQueues[i]->Enqueue({sample, std::nullopt}, sample.priority);
+        }
+
+        return queued;
+    }
+
+    WireFormat DeviceDataFormat() const override
+    {
+        return messageQueues.front()->batchSettings.format;
+    }
+
+    // Drains all destinations at the same time.
+    void Drain(std::chrono::steady_clock::time_point deadline) override
+    {
+        for (auto &messageQueue : messageQueues)
+        {
+            messageQueue->BeginDrain(deadline);
+        }
+
+        for (auto &messageQueue : messageQueues)
+        {
+            messageQueue->EndDrain();
+        }
+    }
+};
\ No newline at end of file
@@ -230,6 +230,7 @@ TartsGateway::~TartsGateway(){
 TartsGateway::TartsGateway(const char* id, uint32_t channelMask, uint8_t uartNum, uint8_t pinActivity, uint8_t pinPCTS, uint8_t pinPRTS, uint8_t pinNRST){
   //Initialized Protected Parameters
   GatewayID = Base36ArrayToInt(id);
+  GatewayIDString = IntToBase36(GatewayID);
   ChannelMask = channelMask;
   UartNum = uartNum;
   PinActivity = pinActivity;
@@ -242,6 +243,8 @@ TartsGateway::TartsGateway(const char* id, uint32_t channelMask, uint8_t uartNum
   _freeOnRemove = isHeapStackVarNotGlobal((int)this);   //Decide on how to dispose of this
       
   //Initialize internal/private variables
+  _lastUnknownID = 0;
+  _lastUnknownSensorType = 0;
   _lastTransactionTime = 0;
   _senObjRemoveList = NULL;
   _senObjList = NULL;
@@ -269,6 +272,7 @@ TartsGateway* TartsGateway::Create(const char* id, uint32_t channelMask, uint8_t
 TartsGateway::TartsGateway(const char* id, uint32_t channelMask, uint8_t address, uint8_t pinDataReady, uint8_t pinReset){
   //Initialized Protected Parameters
   GatewayID = Base36ArrayToInt(id);
+  GatewayIDString = IntToBase36(GatewayID);
   ChannelMask = channelMask;
   Address = address;
   PinDataReady = pinDataReady;
@@ -276,6 +280,8 @@ TartsGateway::TartsGateway(const char* id, uint32_t channelMask, uint8_t address
   _freeOnRemove = isHeapStackVarNotGlobal((int)this);   //Decide on how to dispose of this
       
   //Initialize internal/private variables
+  _lastUnknownID = 0;
+  _lastUnknownSensorType = 0;
   _lastTransactionTime = 0;
   _senObjRemoveList = NULL;
   _senObjList = NULL;
@@ -319,7 +325,7 @@ TartsGateway* TartsGateway::Create(const char* id){
 
    
 const char* TartsGateway::getGatewayID(){
-  return IntToBase36Array(GatewayID);
+  return GatewayIDString.value;
 }
 uint32_t TartsGateway::getChannelMask(){
   return ChannelMask;
@@ -343,7 +349,8 @@ void TartsGateway::reformNetwork(uint32_t newMask){
 
 //Return of 0 means the ID is invalid
 const char* TartsGateway::getLastUnknownID(){
-  return IntToBase36Array(_lastUnknownID);
+  _lastUnknownIDString = IntToBase36(_lastUnknownID);
+  return _lastUnknownIDString.value;
 }
 
 //Return of 0 means the Type is invalid
@@ -372,6 +379,7 @@ TartsLib::TartsLib(){
   SensorPersistEvent  = NULL;
   SensorMessageEvent  = NULL;
   LogExceptionEvent   = NULL;
+  SensorAdmissionEvent = NULL;
   gwObjList           = NULL;
   gwObjListCount      = 0;
 }
@@ -525,6 +533,99 @@ bool TartsLib::RegisterSensor(const char* gatewayID, TartsSensorBase* sensor){
   }
 }
 
+//Open addressing set of sensor IDs used to validate bulk registrations in linear time
+typedef struct {
+  uint32_t id;              //0 marks an empty slot (0 is never a valid sensor ID)
+  TartsSensorBase* sensor;
+  bool onTarget;            //Already registered on the target gateway
+} SensorIDSlot;
+
+static SensorIDSlot* SensorIDSet_find(SensorIDSlot* slots, uint32_t mask, uint32_t id){
+  uint32_t h = (id * 2654435761u) & mask;
+  while((slots[h].id != 0) && (slots[h].id != id)) h = (h + 1) & mask;
+  return &slots[h];
+}
+
+bool TartsLib::RegisterSensors(const char* gatewayID, TartsSensorBase** sensors, int count, bool* registered){
+  if((sensors == NULL) || (count <= 0)) return true;
+  if(registered != NULL) memset((void*)registered, 0, sizeof(bool) * count);
+  
+  uint32_t gwid = Base36ArrayToInt(gatewayID);
+  TartsGateway* targetGW = NULL;
+  int existing = 0;
+  for(int i = 0; i < gwObjListCount; i++){
+    if(gwObjList[i]->GatewayID == gwid) targetGW = gwObjList[i];
+    existing += gwObjList[i]->_senObjListCount;
+  }
+  if(targetGW == NULL){ 
+    LOGEX(11); //"ERROR :: RegisterSensor :: Invalid gateway ID"
+    return false;
+  }
+  if(targetGW->_senObjListCount + count > 0xFFFF){
+    LOGEX(12); //"ERROR :: RegisterSensor :: Memory Exception!"
+    return false;
+  }
+  
+  //Size the set to at most half full
+  uint32_t slotCount = 16;
+  while(slotCount < 2 * (uint32_t)(existing + count)) slotCount <<= 1;
+  SensorIDSlot* slots = (SensorIDSlot*) calloc(slotCount, sizeof(SensorIDSlot));
+  TartsSensorBase** newList = (TartsSensorBase**) realloc((void*)targetGW->_senObjList, sizeof(TartsSensorBase*) * (targetGW->_senObjListCount + count));
+  if(newList != NULL) targetGW->_senObjList = newList;
+  if((slots == NULL) || (newList == NULL)){
+    free(slots);
+    LOGEX(12); //"ERROR :: RegisterSensor :: Memory Exception!"
+    return false;
+  }
+  
+  for(int i = 0; i < gwObjListCount; i++){
+    for(int j = 0; j < gwObjList[i]->_senObjListCount; j++){
+      SensorIDSlot* slot = SensorIDSet_find(slots, slotCount - 1, gwObjList[i]->_senObjList[j]->SensorID);
+      slot->id = gwObjList[i]->_senObjList[j]->SensorID;
+      slot->sensor = gwObjList[i]->_senObjList[j];
+      slot->onTarget = slot->onTarget || (gwObjList[i] == targetGW);
+    }
+  }
+  
+  bool allRegistered = true;
+  int added = 0;
+  for(int k = 0; k < count; k++){
+    TartsSensorBase* sensor = sensors[k];
+    if((sensor == NULL) || (sensor->SensorID == 0)){
+      LOGEX(8); //"ERROR :: RegisterSensor :: Sensor object is NULL/INVALID"
+      allRegistered = false;
+      continue;
+    }
+    SensorIDSlot* slot = SensorIDSet_find(slots, slotCount - 1, sensor->SensorID);
+    if(slot->id != 0){
+      if(slot->sensor != sensor){  //Duplicate has different address
+        LOGEX(9); //"ERROR :: RegisterSensor :: Duplicate ID detected"
+        allRegistered = false;
+        continue;
+      }
+      if(slot->onTarget){ //Duplicate is on the same gateway, No error flagged
+        LOGEX(10); //"WARN  :: RegisterSensor :: Sensor already registered"
+        if(registered != NULL) registered[k] = true;
+        continue;
+      }
+      //else: This is OK to have the sensor on another gateway
+    }
+    slot->id = sensor->SensorID;
+    slot->sensor = sensor;
+    slot->onTarget = true;
+    targetGW->_senObjList[targetGW->_senObjListCount + added] = sensor;
+    if(registered != NULL) registered[k] = true;
+    added++;
+  }
+  free(slots);
+  
+  if(added != 0){
+    targetGW->_senObjListCount += added;
+    targetGW->_loadNeeded = true;
+  }
+  return allRegistered;
+}
+
 void TartsLib::RemoveSensor(const char* sensorID){
   int k = 0;
   TartsSensorBase** newList;
@@ -583,6 +684,22 @@ TartsSensorBase* TartsLib::FindSensorInternal(uint32_t sensorID){
   return NULL;
 }
 
+//Ask the application whether an unregistered sensor may join and register it on the gateway that heard it
+TartsSensorBase* TartsLib::AdmitSensorInternal(TartsGateway* gateway, uint32_t sensorID, uint16_t sensorType){
+  if(SensorAdmissionEvent == NULL) return NULL;
+  
+  TartsIDString id = IntToBase36(sensorID);
+  TartsSensorBase* sensor = SensorAdmissionEvent(id.value, sensorType);
+  if(sensor == NULL) return NULL;
+  
+  if((sensor->SensorID != sensorID) || !RegisterSensor(gateway->getGatewayID(), sensor)){
+    if(sensor->_freeOnRemove) delete sensor;
+    return NULL;
+  }
+  LOGGWM(gateway->getGatewayID(),11); //"Unregistered sensor admitted on first contact"
+  return sensor;
+}
+
 
 void TartsLib::RegisterEvent_GatewayPersist(GatewayPersistEvent_t function){
   if(function != NULL) GatewayPersistEvent = function;  
@@ -599,6 +716,9 @@ void TartsLib::RegisterEvent_SensorMessage(SensorMessageEvent_t function){
 void TartsLib::RegisterEvent_LogException(LogExceptionEvent_t function){
   if(function != NULL) LogExceptionEvent = function;  
 }
+void TartsLib::RegisterEvent_SensorAdmission(SensorAdmissionEvent_t function){
+  if(function != NULL) SensorAdmissionEvent = function;  
+}
 
 void TartsLib::Process(void){
   for(int i = 0; i < gwObjListCount; i++){
@@ -652,16 +772,22 @@ void TartsLib::Process(void){
         }
         else if(gwObjList[i]->_state == ACTIVE) {         //Process SENSOR TRAFFIC when Active
           TartsSensorBase* senObj = FindSensorInternal(id);
+          bool admitted = false;
           if(senObj == NULL){
             if((inmsg.getCommand() == DATA_MESSAGE) || (inmsg.getCommand() == DATA_MESSAGE_DL)){
-              gwObjList[i]->_lastUnknownID = id;
-              gwObjList[i]->_lastUnknownSensorType = (((uint16_t)inmsg.buffer[12]) << 8) | (uint16_t)inmsg.buffer[11];
-              LOGGWM(gwObjList[i]->getGatewayID(),3); //"Unregistered sensor traffic detected!"
+              uint16_t type = (inmsg.getCommand() == DATA_MESSAGE) ? (uint16_t)((inmsg.buffer[12] << 8) | inmsg.buffer[11]) : (uint16_t)((inmsg.buffer[16] << 8) | inmsg.buffer[15]);
+              senObj = AdmitSensorInternal(gwObjList[i], id, type);
+              admitted = (senObj != NULL);
+              if(!admitted){
+                gwObjList[i]->_lastUnknownID = id;
+                gwObjList[i]->_lastUnknownSensorType = type;
+                LOGGWM(gwObjList[i]->getGatewayID(),3); //"Unregistered sensor traffic detected!"
+              }
             }
           }
-          else{ //Good sensor object
-            //Handle Pending Configs
-            if(senObj->pendingActions()){
+          if(senObj != NULL){ //Good sensor object
+            //Handle Pending Configs (a sensor admitted by this very message is not loaded in the gateway yet)
+            if(!admitted && senObj->pendingActions()){
               //HANDLE INBOUND IF ACK-2-COMMAND
               if(inmsg.getCommand() == READ_DATASECTOR_RESPONSE){
                 if(inmsg.buffer[8] == 24) senObj->_parseGeneralConfig1(inmsg.buffer[9], &inmsg.buffer[10]);
@@ -711,7 +837,7 @@ void TartsLib::Process(void){
               
               if(!senObj->pendingActions()){
                 TartsGateway_sendQueuedNotfication(gwObjList[i]->Address, id, 0); 
-                LOGSENP(IntToBase36Array(id));
+                LOGSENP(senObj->getSensorID());
               }
             }
         
@@ -719,18 +845,18 @@ void TartsLib::Process(void){
             if(inmsg.getCommand() == DATA_MESSAGE){
               //RSSI: inmsg.buffer[9]
               //Battery: ((float) (((uint16_t)inmsg.buffer[10])+150)/100.0);
-              SensorMessage sensorMessage = SensorMessage(senObj->getSensorID(), (int8_t)inmsg.buffer[9], (int16_t)inmsg.buffer[10] + 150, NULL);
+              SensorMessage sensorMessage = SensorMessage(senObj->getSensorID(), senObj->SensorType, (int8_t)inmsg.buffer[9], (int16_t)inmsg.buffer[10] + 150, NULL);
               uint16_t type = (uint16_t)((inmsg.buffer[12] << 8) | inmsg.buffer[11]);
               if((senObj->SensorType != type) && (type != 0xFFFF)) LOGEX(16); //"WARN  :: Sensor type mismatch!"
-              if(GatewayMessageEvent != NULL) senObj->_parseData(SensorMessageEvent, &sensorMessage, &inmsg.buffer[13]); //Start at State!
+              if(SensorMessageEvent != NULL) senObj->_parseData(SensorMessageEvent, &sensorMessage, &inmsg.buffer[13]); //Start at State!
             }
             else if(inmsg.getCommand() == DATA_MESSAGE_DL){
               //RSSI: inmsg.buffer[13]
               //Battery: ((float) (((uint16_t)inmsg.buffer[14])+150)/100.0);
-              SensorMessage sensorMessage = SensorMessage(senObj->getSensorID(), (int8_t)inmsg.buffer[13], (int16_t)inmsg.buffer[14] + 150, NULL);
+              SensorMessage sensorMessage = SensorMessage(senObj->getSensorID(), senObj->SensorType, (int8_t)inmsg.buffer[13], (int16_t)inmsg.buffer[14] + 150, NULL);
               uint16_t type = (uint16_t)((inmsg.buffer[16] << 8) | inmsg.buffer[15]);
               if((senObj->SensorType != type) && (type != 0xFFFF)) LOGEX(16); //"WARN  :: Sensor type mismatch!"
-              if(GatewayMessageEvent != NULL) senObj->_parseData(SensorMessageEvent, &sensorMessage, &inmsg.buffer[17]); //Start at State!
+              if(SensorMessageEvent != NULL) senObj->_parseData(SensorMessageEvent, &sensorMessage, &inmsg.buffer[17]); //Start at State!
             }
           }
         }          
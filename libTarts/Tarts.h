@@ -47,11 +47,12 @@ class SensorMessage
 {
   public:
     ~SensorMessage(){}
-    SensorMessage(const char* id, int8_t rssiValue, int16_t batteryVoltageValue, Datum* list){
-      ID = id; RSSI = rssiValue; BatteryVoltage = batteryVoltageValue; DatumList = list;
+    SensorMessage(const char* id, uint16_t sensorType, int8_t rssiValue, int16_t batteryVoltageValue, Datum* list){
+      ID = id; SensorType = sensorType; RSSI = rssiValue; BatteryVoltage = batteryVoltageValue; DatumList = list;
     }
     
     const char* ID;
+    uint16_t SensorType;  //TartsSensorTypes of the registered sensor object
     int8_t RSSI;
     uint16_t BatteryVoltage;
     Datum* DatumList;
@@ -71,6 +72,12 @@ typedef void (*SensorPersistEvent_t)(const char* id);
 typedef void (*SensorMessageEvent_t)(SensorMessage* message);
 typedef void (*LogExceptionEvent_t)(int stringID);
 
+//Called when an unregistered sensor sends data.  Return a sensor object (e.g. from a
+//sensor's Create method) to register it on that gateway and have the triggering data
+//message decoded immediately, or NULL to leave the sensor unregistered.
+class TartsSensorBase;
+typedef TartsSensorBase* (*SensorAdmissionEvent_t)(const char* id, uint16_t sensorType);
+
 #include "TartsSensors.h"
 
 
@@ -141,6 +148,7 @@ class TartsGateway
     
   protected:
     uint32_t GatewayID;       
+    TartsIDString GatewayIDString;  //Canonical "T..." label, encoded once at construction
     uint32_t ChannelMask;    
 
     #if defined(BB_BLACK_ARCH)
@@ -159,13 +167,14 @@ class TartsGateway
     
   private:
     uint32_t _lastUnknownID;
+    TartsIDString _lastUnknownIDString;
     uint16_t _lastUnknownSensorType;
     unsigned long _lastTransactionTime;
     TartsSensorBase** _senObjList;
     uint32_t* _senObjRemoveList;
-    uint8_t  _senObjListCount;
-    uint8_t  _senObjRemoveListCount;
-    uint8_t  _senObjProcessListCount;
+    uint16_t _senObjListCount;
+    uint16_t _senObjRemoveListCount;
+    uint16_t _senObjProcessListCount;
     uint8_t  _wirelessState;
     uint8_t  _sensorCount;
     uint8_t  _channel;
@@ -204,6 +213,12 @@ class TartsLib
     
     //Sensor Operations-----------------------------------------------------------
     bool RegisterSensor(const char* gatewayID, TartsSensorBase* sensor);
+    //Registers many sensors on one gateway with a single list allocation and a single load cycle.
+    //Invalid or conflicting sensors are reported through LogException and skipped.  No SensorPersist
+    //events are raised since the caller already holds the list.  Returns true if every sensor ends up registered.
+    //If registered is not NULL it receives count flags, true for each sensor now held by the gateway; the
+    //caller still owns the others.
+    bool RegisterSensors(const char* gatewayID, TartsSensorBase** sensors, int count, bool* registered = NULL);
     void RemoveSensor(const char* sensorID);
     TartsSensorBase* FindSensor(const char* sensorID);
     
@@ -213,6 +228,7 @@ class TartsLib
     void RegisterEvent_SensorPersist(SensorPersistEvent_t function);
     void RegisterEvent_SensorMessage(SensorMessageEvent_t function);
     void RegisterEvent_LogException(LogExceptionEvent_t function);
+    void RegisterEvent_SensorAdmission(SensorAdmissionEvent_t function);
 
     //Method called frequently to enable Tarts Gateway and Sensor Processing
     void Process();
@@ -225,7 +241,9 @@ class TartsLib
     SensorPersistEvent_t  SensorPersistEvent;
     SensorMessageEvent_t  SensorMessageEvent;
     LogExceptionEvent_t   LogExceptionEvent;
+    SensorAdmissionEvent_t SensorAdmissionEvent;
     TartsSensorBase* FindSensorInternal(uint32_t sensorID);
+    TartsSensorBase* AdmitSensorInternal(TartsGateway* gateway, uint32_t sensorID, uint16_t sensorType);
 };
 
 extern TartsLib Tarts;
@@ -0,0 +1,174 @@
+/**********************************************************************************
+ * TartsBatch.cpp :: Offline batch decoding of captured GWAPI frames              *
+ **********************************************************************************
+ *   This file is distributed in the hope that it will be useful, but WITHOUT     *
+ *   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or        *
+ *   FITNESS FOR A PARTICULAR PURPOSE.  Further inquiries in to licences can be   *
+ *   found at www.tartssensors.com/licenses                                       *
+ *********************************************************************************/
+
+#include "TartsBatch.h"
+
+#define TARTS_START_FRAME_DELIMINATOR   0xC5
+#define TARTS_DATA_MESSAGE              0x55
+#define TARTS_DATA_MESSAGE_DL           0x56
+
+//Rows are selected and then extracted column by column in chunks of this size,
+//so each column loop is a tight, branch free pass over already validated frames.
+#define TARTS_BATCH_CHUNK_SIZE          256
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//Field Extraction Helpers
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+
+//GWAPI is little-endian; on little-endian hosts these compile to plain (unaligned) loads.
+static inline uint16_t readLE16(const uint8_t* p){
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint16_t v;
+  memcpy((void*)&v, (const void*)p, sizeof(v));
+  return v;
+#else
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+#endif
+}
+
+static inline uint32_t readLE32(const uint8_t* p){
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint32_t v;
+  memcpy((void*)&v, (const void*)p, sizeof(v));
+  return v;
+#else
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+#endif
+}
+
+static inline uint8_t fieldWidth(uint8_t format){
+  switch(format){
+    case TARTS_FIELD_BOOL:   return 1;
+    case TARTS_FIELD_INT16:
+    case TARTS_FIELD_UINT16: return 2;
+    case TARTS_FIELD_UINT32: return 4;
+    default:                 return 0;
+  }
+}
+
+static inline int64_t readField(const uint8_t* data, TartsDataField field){
+  switch(field.Format){
+    case TARTS_FIELD_BOOL:   return (data[field.Offset] == 0) ? 0 : 1;
+    case TARTS_FIELD_INT16:  return (int16_t)readLE16(&data[field.Offset]);
+    case TARTS_FIELD_UINT16: return readLE16(&data[field.Offset]);
+    case TARTS_FIELD_UINT32: return readLE32(&data[field.Offset]);
+    default:                 return 0;
+  }
+}
+
+//Table driven version of GWAPI::calculateCRC8 (polynomial 0x97)
+struct TartsCRC8Table{
+  uint8_t table[256];
+  TartsCRC8Table(){
+    for(int i = 0; i < 256; i++){
+      uint8_t crc = (uint8_t)i;
+      for(int j = 8; j > 0; j--){
+        if(crc & 0x80) crc = (crc << 1) ^ 0x97;
+        else crc = crc << 1;
+      }
+      table[i] = crc;
+    }
+  }
+};
+
+static uint8_t calculateCRC8(const uint8_t* frame){
+  static const TartsCRC8Table crc8;
+  uint8_t crc = 0;
+  for(int i = 0; i < frame[1]; i++) crc = crc8.table[crc ^ frame[2+i]];
+  return crc;
+}
+
+//Returns the offset of the RSSI byte (start of the data header) or 0 if the frame does not decode to a row
+static uint8_t dataHeaderOffset(const uint8_t* frame, size_t frameStride){
+  if(frame[0] != TARTS_START_FRAME_DELIMINATOR) return 0;
+  if((size_t)frame[1] + 3 > frameStride) return 0;
+
+  uint8_t header;
+  if(frame[3] == TARTS_DATA_MESSAGE) header = 9;
+  else if(frame[3] == TARTS_DATA_MESSAGE_DL) header = 13;
+  else return 0;
+
+  //RSSI, battery, type(2) and state must be inside the frame, before the CRC
+  if(header + 5 > frame[1] + 2) return 0;
+  if(calculateCRC8(frame) != frame[frame[1]+2]) return 0;
+
+  const TartsDataLayout* layout = TartsSensorDataLayout(readLE16(&frame[header+2]));
+  for(int f = 0; f < layout->FieldCount; f++){
+    if(header + 4 + layout->Fields[f].Offset + fieldWidth(layout->Fields[f].Format) > frame[1] + 2) return 0;
+  }
+  return header;
+}
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//Batch Decoder
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+
+size_t TartsDecodeFrames(const uint8_t* frames, size_t frameCount, size_t frameStride, const uint64_t* timestamps, TartsFrameColumns* columns){
+  const uint8_t* frame[TARTS_BATCH_CHUNK_SIZE];
+  const uint8_t* header[TARTS_BATCH_CHUNK_SIZE];
+  size_t source[TARTS_BATCH_CHUNK_SIZE];
+  size_t rows = 0;
+  size_t n = 0;
+
+  if((frames == NULL) || (columns == NULL) || (frameStride < 4)) return 0;
+
+  while(n < frameCount){
+    //Select the frames that decode to a row
+    int count = 0;
+    for(; (n < frameCount) && (count < TARTS_BATCH_CHUNK_SIZE); n++){
+      const uint8_t* f = frames + (n * frameStride);
+      uint8_t offset = dataHeaderOffset(f, frameStride);
+      if(offset == 0) continue;
+      frame[count] = f;
+      header[count] = f + offset;
+      source[count] = n;
+      count++;
+    }
+
+    //Extract one column at a time
+    if(columns->SensorID != NULL){
+      for(int i = 0; i < count; i++) columns->SensorID[rows+i] = readLE32(&frame[i][4]);
+    }
+    if(columns->RSSI != NULL){
+      for(int i = 0; i < count; i++) columns->RSSI[rows+i] = (int8_t)header[i][0];
+    }
+    if(columns->BatteryVoltage != NULL){
+      for(int i = 0; i < count; i++) columns->BatteryVoltage[rows+i] = (uint16_t)header[i][1] + 150;
+    }
+    if(columns->SensorType != NULL){
+      for(int i = 0; i < count; i++) columns->SensorType[rows+i] = readLE16(&header[i][2]);
+    }
+    if(columns->State != NULL){
+      for(int i = 0; i < count; i++) columns->State[rows+i] = header[i][4];
+    }
+    if(columns->Timestamp != NULL){
+      for(int i = 0; i < count; i++) columns->Timestamp[rows+i] = (timestamps != NULL) ? timestamps[source[i]] : 0;
+    }
+    if((columns->Value1 != NULL) || (columns->Value2 != NULL)){
+      for(int i = 0; i < count; i++){
+        const TartsDataLayout* layout = TartsSensorDataLayout(readLE16(&header[i][2]));
+        const uint8_t* data = &header[i][4];
+        if(columns->Value1 != NULL) columns->Value1[rows+i] = (layout->FieldCount > 0) ? readField(data, layout->Fields[0]) : 0;
+        if(columns->Value2 != NULL) columns->Value2[rows+i] = (layout->FieldCount > 1) ? readField(data, layout->Fields[1]) : 0;
+      }
+    }
+
+    rows += count;
+  }
+
+  return rows;
+}
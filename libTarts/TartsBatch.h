@@ -0,0 +1,47 @@
+/**********************************************************************************
+ * TartsBatch.h :: Offline batch decoding of captured GWAPI frames                *
+ **********************************************************************************
+ *   This file is distributed in the hope that it will be useful, but WITHOUT     *
+ *   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or        *
+ *   FITNESS FOR A PARTICULAR PURPOSE.  Further inquiries in to licences can be   *
+ *   found at www.tartssensors.com/licenses                                       *
+ *********************************************************************************/
+
+#ifndef TartsBatch_h
+#define TartsBatch_h
+
+#include "Tarts.h"
+
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+//BATCH FRAME DECODER
+//Decodes raw frames captured from the gateway UART (e.g. for replaying a day of
+//traffic) without going through TartsLib::Process, the gateway state machine or
+//the per-message callbacks.  Only DATA_MESSAGE and DATA_MESSAGE_DL frames with a
+//valid start delimiter and CRC produce a row; everything else is skipped.
+//
+//Frames are read from one contiguous buffer, frame n starting at
+//frames + n * frameStride.  A stride of TARTS_BATCH_FRAME_SIZE matches the
+//GWAPI buffer used by the library.
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+
+#define TARTS_BATCH_FRAME_SIZE  32
+
+//Caller owned output columns, each with room for frameCount rows.
+//Any column may be NULL if it is not needed.
+typedef struct {
+  uint32_t* SensorID;
+  uint16_t* SensorType;       //Type reported in the frame (0xFFFF if the sensor did not report it)
+  uint64_t* Timestamp;        //Copied from the caller's capture timestamps
+  int8_t*   RSSI;
+  uint16_t* BatteryVoltage;   //Hundredths of a volt, as in SensorMessage
+  uint8_t*  State;            //State byte preceding the sensor data
+  int64_t*  Value1;           //First datum in DatumList order, raw (unscaled); wide enough for UINT32 fields
+  int64_t*  Value2;           //Second datum, 0 when the sensor type has only one
+} TartsFrameColumns;
+
+//Returns the number of rows written.  timestamps may be NULL.
+size_t TartsDecodeFrames(const uint8_t* frames, size_t frameCount, size_t frameStride, const uint64_t* timestamps, TartsFrameColumns* columns);
+
+#endif //TartsBatch_h
@@ -55,21 +55,32 @@ bool isHeapStackVarNotGlobal( int ptrAddress){
 //-----------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------------------------
-char fixedReturnBuffer[10]; //"T12345<0>"
-const char* IntToBase36Array(uint32_t value){
-  char baseChars[] = {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T','U','V','W','X','Y','Z'};
-  
-  int i = sizeof(fixedReturnBuffer); // Maximum size Buffer for Tarts labels
-  fixedReturnBuffer[--i] = 0; //Set Null
+static const char baseChars[] = {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T','U','V','W','X','Y','Z'};
+
+TartsIDString IntToBase36(uint32_t value){
+  TartsIDString id;
+  char digits[TARTS_ID_STRING_SIZE];
+  int i = 0;
   
   do{
-    fixedReturnBuffer[--i] = baseChars[value % 36];
+    digits[i++] = baseChars[value % 36];
     value /= 36;
   }
   while (value > 0);
-  while (i > 4) fixedReturnBuffer[--i] = '0';
-  fixedReturnBuffer[--i] = 'T';
-  return &fixedReturnBuffer[i];
+  while (i < 5) digits[i++] = '0';
+  
+  int j = 0;
+  id.value[j++] = 'T';
+  while (i > 0) id.value[j++] = digits[--i];
+  id.value[j] = 0; //Set Null
+  return id;
+}
+
+char fixedReturnBuffer[TARTS_ID_STRING_SIZE]; //"T12345<0>"
+const char* IntToBase36Array(uint32_t value){
+  TartsIDString id = IntToBase36(value);
+  memcpy((void*)fixedReturnBuffer, (void*)id.value, sizeof(fixedReturnBuffer));
+  return fixedReturnBuffer;
 }
 
 uint32_t Base36ArrayToInt(const char* value){
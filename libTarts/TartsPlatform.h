@@ -242,6 +242,13 @@ extern bool Platform_gatewayInitialize(uint8_t uartNum, uint8_t pinActivity, uin
 extern bool Platform_gatewayInitialize(uint8_t addr, uint8_t pinReset, uint8_t pinDataReady);
 #endif
 
+//Tarts labels are "T" followed by at least five Base36 digits ("T12345<0>").
+//IntToBase36 returns the label by value, so it is safe to call from any thread.
+//IntToBase36Array is kept for compatibility and shares one static buffer.
+#define TARTS_ID_STRING_SIZE  10
+typedef struct { char value[TARTS_ID_STRING_SIZE]; } TartsIDString;
+
+TartsIDString IntToBase36(uint32_t value);
 const char* IntToBase36Array(uint32_t value);
 uint32_t Base36ArrayToInt(const char* value);
 
@@ -17,6 +17,57 @@
 #define DEFAULT_PROFILE_INT	1
 #define DEFAULT_PROFILE_TRG	2
 
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//Sensor Data Layouts (must match the _parseData implementations below)
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------------------------------
+
+static const TartsDataLayout NoDataLayout     = { 0, { {0, TARTS_FIELD_NONE},   {0, TARTS_FIELD_NONE} } };
+static const TartsDataLayout StateLayout      = { 1, { {1, TARTS_FIELD_BOOL},   {0, TARTS_FIELD_NONE} } };
+static const TartsDataLayout Signed16Layout   = { 1, { {1, TARTS_FIELD_INT16},  {0, TARTS_FIELD_NONE} } };
+static const TartsDataLayout Unsigned16Layout = { 1, { {1, TARTS_FIELD_UINT16}, {0, TARTS_FIELD_NONE} } };
+static const TartsDataLayout Unsigned32Layout = { 1, { {1, TARTS_FIELD_UINT32}, {0, TARTS_FIELD_NONE} } };
+static const TartsDataLayout HumidityLayout   = { 2, { {3, TARTS_FIELD_INT16},  {1, TARTS_FIELD_INT16} } };  //RH, TEMPERATURE
+static const TartsDataLayout TiltLayout       = { 2, { {1, TARTS_FIELD_INT16},  {3, TARTS_FIELD_INT16} } };  //PITCH, ROLL
+
+const TartsDataLayout* TartsSensorDataLayout(uint16_t type){
+  switch(type){
+    case Temperature:
+    case WaterTemperature:
+    case Compass:
+      return &Signed16Layout;
+    case Humidity:
+      return &HumidityLayout;
+    case Tilt:
+      return &TiltLayout;
+    case DryContact:
+    case WaterDetect:
+    case WaterRope:
+    case OpenClose:
+    case Button:
+    case PassiveIR:
+    case Activity:
+    case VACDetect:
+    case VDCDetect:
+    case BasicControl:
+      return &StateLayout;
+    case Measure20mA:
+    case Measure1VDC:
+    case Measure5VDC:
+    case Measure10VDC:
+    case Measure50VDC:
+    case Measure500VAC:
+      return &Unsigned16Layout;
+    case Resistance:
+      return &Unsigned32Layout;
+    default:
+      return &NoDataLayout;  //Asset and unknown types carry no value
+  }
+}
+
 //-----------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------------------------
@@ -29,6 +80,7 @@ TartsSensorBase::~TartsSensorBase(){}
 
 TartsSensorBase::TartsSensorBase(const char * sensorID, TartsSensorTypes type, uint16_t reportInterval, uint8_t linkInterval, uint8_t retryCount, uint8_t recovery){
   SensorID = Base36ArrayToInt(sensorID);
+  SensorIDString = IntToBase36(SensorID);
   SensorType = type;
   ReportInterval = reportInterval;
   LinkInterval = linkInterval;
@@ -74,7 +126,7 @@ void TartsSensorBase::setRecovery(uint16_t recovery){
 }
 
 //Parameters to get
-const char * TartsSensorBase::getSensorID(){ return IntToBase36Array(SensorID); }
+const char * TartsSensorBase::getSensorID(){ return SensorIDString.value; }
 TartsSensorTypes TartsSensorBase::getSensorType(){ return SensorType; }
 uint16_t TartsSensorBase::getReportInterval(){ return ReportInterval; }
 uint8_t  TartsSensorBase::getLinkInterval(){ return LinkInterval; }
@@ -38,6 +38,29 @@ typedef enum {Temperature = 2, WaterTemperature = 65, Humidity = 43,
               Tilt=75, Compass=28, BasicControl=76,
               Unknown = 0xFFFF} TartsSensorTypes;
 
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+//SENSOR DATA LAYOUTS
+//Binary position of each datum within a data message, starting at the state byte
+//that is handed to _parseData.  Fields are listed in DatumList order.
+//-------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------
+
+typedef enum {TARTS_FIELD_NONE = 0, TARTS_FIELD_BOOL, TARTS_FIELD_INT16, TARTS_FIELD_UINT16, TARTS_FIELD_UINT32} TartsFieldFormat;
+
+typedef struct {
+  uint8_t Offset;
+  uint8_t Format;   //TartsFieldFormat
+} TartsDataField;
+
+typedef struct {
+  uint8_t FieldCount;
+  TartsDataField Fields[2];
+} TartsDataLayout;
+
+//Returns a layout with FieldCount == 0 for unknown sensor types
+const TartsDataLayout* TartsSensorDataLayout(uint16_t type);
+
 //-------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------
 //ABSTRACT SENSOR BASE CLASS
@@ -51,7 +74,7 @@ class TartsSensorBase
 { 
   friend class TartsLib;  
   public:
-    ~TartsSensorBase();                                      //Destructor
+    virtual ~TartsSensorBase();                              //Destructor
     TartsSensorBase(const char* sensorID, TartsSensorTypes type, uint16_t reportInterval, uint8_t linkInterval, uint8_t retryCount, uint8_t recovery);
     
     //Methods to change sensor configurations.
@@ -74,6 +97,7 @@ class TartsSensorBase
     
   protected:
     uint32_t SensorID;
+    TartsIDString SensorIDString; //Canonical "T..." label, encoded once at construction
     TartsSensorTypes SensorType;
     uint16_t ReportInterval;
     uint8_t  LinkInterval;
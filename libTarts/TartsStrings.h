@@ -28,7 +28,8 @@ const char* TartsGatewayStringTable[] = {
   /*7*/   "STATE::REMOVING", \
   /*8*/   "STATE::LOADING", \
   /*9*/   "STATE::ACTIVATING", \
-  /*10*/  "STATE::ACTIVE" \
+  /*10*/  "STATE::ACTIVE", \
+  /*11*/  "Unregistered sensor admitted on first contact" \
 };
 
 const char* TartsExceptionStringTable[] = { 
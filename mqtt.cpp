@@ -0,0 +1,879 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// With JOTTAI_MQTT_HOST set device data is published to an MQTT broker instead of
+// being posted to the jottai REST API. Each reading is a QoS 1 message on the topic
+// <topicPrefix>/<device ID>, its payload a single reading batch as it would be
+// posted to the API. protocolVersion is 4 for MQTT 3.1.1 or 5 for MQTT 5.
+//
+// The session is kept by the broker (no clean session) for sessionExpiry, MQTT 5
+// only, so after a reconnect the broker still knows the client and messages that
+// were not acknowledged are sent again with the DUP flag.
+struct MqttSettings
+{
+    std::string host;
+    std::string port;
+    std::string clientId;
+    std::string username;
+    std::string password;
+    std::string topicPrefix;
+    int protocolVersion;
+    std::chrono::seconds keepAlive;
+    std::chrono::seconds connectTimeout;
+    uint32_t sessionExpiry;
+    size_t maxInFlight;
+    size_t queueCapacity;
+
+    static bool IsConfigured()
+    {
+        return getenv("JOTTAI_MQTT_HOST") != nullptr;
+    }
+
+    static MqttSettings FromEnvironment()
+    {
+        auto gatewayId = std::string(getenv("GATEWAY_ID") != nullptr ? getenv("GATEWAY_ID") : "");
+
+        return {
+            getenv("JOTTAI_MQTT_HOST"),
+            std::to_string(EnvironmentOrDefault("JOTTAI_MQTT_PORT", 1883)),
+            StringOrDefault("JOTTAI_MQTT_CLIENT_ID", "tarts-" + gatewayId),
+            StringOrDefault("JOTTAI_MQTT_USERNAME", ""),
+            StringOrDefault("JOTTAI_MQTT_PASSWORD", ""),
+            StringOrDefault("JOTTAI_MQTT_TOPIC_PREFIX", "jottai/" + gatewayId),
+            EnvironmentOrDefault("JOTTAI_MQTT_VERSION", 4) == 5 ? 5 : 4,
+            std::chrono::seconds(std::max(1L, EnvironmentOrDefault("JOTTAI_MQTT_KEEP_ALIVE_S", 60))),
+            std::chrono::seconds(std::max(1L, EnvironmentOrDefault("JOTTAI_MQTT_CONNECT_TIMEOUT_S", 10))),
+            (uint32_t)std::max(0L, EnvironmentOrDefault("JOTTAI_MQTT_SESSION_EXPIRY_S", 24 * 60 * 60)),
+            (size_t)std::min(65535L, std::max(1L, EnvironmentOrDefault("JOTTAI_MQTT_MAX_IN_FLIGHT", 20))),
+            (size_t)std::max(1L, EnvironmentOrDefault("JOTTAI_QUEUE_CAPACITY", 1024))};
+    }
+
+private:
+    static std::string StringOrDefault(const char *name, const std::string &defaultValue)
+    {
+        auto value = getenv(name);
+
+        return value != nullptr ? value : defaultValue;
+    }
+};
+
+// Minimal MQTT client, just what publishing at QoS 1 needs.
+enum MqttPacketType : uint8_t
+{
+    MqttConnect = 1,
+    MqttConnAck = 2,
+    MqttPublish = 3,
+    MqttPubAck = 4,
+    MqttPingReq = 12,
+    MqttPingResp = 13,
+    MqttDisconnect = 14
+};
+
+const uint8_t MqttSessionExpiryProperty = 0x11;
+
+void AppendMqttLength(std::string &buffer, size_t length)
+{
+    do
+    {
+        uint8_t digit = length % 128;
+
+        length /= 128;
+        buffer += (char)(length > 0 ? digit | 0x80 : digit);
+    } while (length > 0);
+}
+
+void AppendMqttUint16(std::string &buffer, uint16_t value)
+{
+    buffer += (char)(value >> 8);
+    buffer += (char)value;
+}
+
+void AppendMqttString(std::string &buffer, const std::string &value)
+{
+    AppendMqttUint16(buffer, value.size());
+    buffer += value;
+}
+
+std::string MqttPacket(MqttPacketType type, uint8_t flags, const std::string &body)
+{
+    std::string packet;
+
+    packet += (char)(type << 4 | flags);
+    AppendMqttLength(packet, body.size());
+    packet += body;
+
+    return packet;
+}
+
+// Publishes device data over one persistent connection. Like the HTTP uploader
+// a worker thread owns the connection and takes readings from a lock-free queue.
+// Up to maxInFlight messages wait for their PUBACK at a time; while the broker is
+// unreachable readings wait in a DeviceBacklog, set up like the HTTP uploader's.
+// Alarms have a queue of their own and are published first, even with the window
+// full. With JOTTAI_OUTBOX_DIR set, readings the broker has not acknowledged when a
+// drain ends are stored in its mqtt subdirectory and published after the next
+// connect, before the backlog.
+class MqttPublisher : public DeviceDataSink
+{
+public:
+    MqttPublisher(MqttSettings settings, WireFormat format)
+        : settings(settings),
+          format(format),
+          active(true),
+          draining(false),
+          incoming(settings.queueCapacity),
+          incomingAlarms(AlarmSettings::FromEnvironment().queueCapacity),
+          backlog(UploadSettings::FromEnvironment().backlog),
+          droppedMessages(0),
+          reportedDroppedMessages(0),
+          wakeUp(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          addresses(nullptr),
+          socket(-1),
+          connected(false),
+          awaitingPingResponse(false),
+          nextPacketId(1),
+          reconnectAttempts(0),
+          reconnectTime(std::chrono::steady_clock::now()),
+          random(std::random_device()())
+    {
+        auto outboxSettings = OutboxDrainSettings::FromEnvironment().outbox;
+
+        if (!outboxSettings.directory.empty())
+        {
+            // The outbox creates its own directory only
+            mkdir(outboxSettings.directory.c_str(), 0755);
+            outboxSettings.directory += "/mqtt";
+
+            if (!outbox.Open(outboxSettings))
+            {
+                std::cerr << "Continuing without an outbox" << std::endl;
+            }
+        }
+
+        thread = std::thread(Worker, this);
+    }
+
+    ~MqttPublisher()
+    {
+        active = false;
+        Wake();
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+        Disconnect();
+        close(wakeUp);
+
+        if (addresses != nullptr)
+        {
+            freeaddrinfo(addresses);
+        }
+    }
+
+    bool EnqueueDeviceData(const SensorSample &sample) override
+    {
+        auto &queue = sample.priority == DeviceDataPriority::Alarm ? incomingAlarms : incoming;
+
+        if (!queue.TryPush(SensorSample(sample)))
+        {
+            droppedMessages++;
+
+            return false;
+        }
+
+        Wake();
+
+        return true;
+    }
+
+    WireFormat DeviceDataFormat() const override
+    {
+        return format;
+    }
+
+    // Publishes what is queued until the broker has acknowledged it all or the
+    // deadline passes. Readings still unacknowledged then are stored in the outbox.
+    void Drain(std::chrono::steady_clock::time_point deadline) override
+    {
+        drainDeadline = deadline;
+        draining = true;
+        Wake();
+        thread.join();
+    }
+
+private:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    struct InFlightMessage
+    {
+        uint16_t packetId;
+        uint32_t deviceId;
+        std::string packet;
+        size_t payloadOffset; // of the reading batch in packet
+        uint64_t outboxSegment; // 0 unless the reading was read back from the outbox
+    };
+
+    const MqttSettings settings;
+    const WireFormat format;
+    std::atomic<bool> active;
+    std::atomic<bool> draining;
+    TimePoint drainDeadline; // written before draining is set
+    BoundedMpscQueue<SensorSample> incoming;
+    BoundedMpscQueue<SensorSample> incomingAlarms;
+    DeviceBacklog backlog;
+    DeviceDataSerializer serializer;
+    Outbox outbox;
+    std::atomic<size_t> droppedMessages;
+    size_t reportedDroppedMessages;
+    int wakeUp;
+    struct addrinfo *addresses; // of the broker, resolved again once none of them connects
+    int socket;
+    bool connected; // CONNACK received
+    bool awaitingPingResponse;
+    uint16_t nextPacketId;
+    int reconnectAttempts;
+    TimePoint reconnectTime;
+    TimePoint lastSendTime;
+    std::deque<InFlightMessage> inFlight;
+    std::string received;
+    std::minstd_rand random;
+    std::thread thread;
+
+    void Wake()
+    {
+        uint64_t one = 1;
+
+        if (write(wakeUp, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            std::cerr << "Failed to wake up the MQTT publisher: " << strerror(errno) << std::endl;
+        }
+    }
+
+    // The broker's address is resolved on the first connect and kept, so that a
+    // reconnect, while draining in particular, does not wait for DNS. It is resolved
+    // again when none of the addresses connects, unless draining.
+    int OpenSocket()
+    {
+        if (addresses == nullptr)
+        {
+            struct addrinfo hints = {};
+
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+
+            auto error = getaddrinfo(settings.host.c_str(), settings.port.c_str(), &hints, &addresses);
+
+            if (error != 0)
+            {
+                std::cerr << "Failed to resolve MQTT broker " << settings.host << ": " << gai_strerror(error) << std::endl;
+                addresses = nullptr;
+
+                return -1;
+            }
+        }
+
+        int fd = -1;
+
+        for (auto address = addresses; address != nullptr && fd < 0; address = address->ai_next)
+        {
+            fd = ConnectTo(address);
+        }
+
+        if (fd < 0)
+        {
+            std::cerr << "Failed to connect to MQTT broker " << settings.host << ":" << settings.port << ": " << strerror(errno) << std::endl;
+
+            if (!draining)
+            {
+                freeaddrinfo(addresses);
+                addresses = nullptr;
+            }
+
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+        int noDelay = 1;
+        struct timeval sendTimeout = {10, 0};
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        return fd;
+    }
+
+    // Connects without blocking for longer than connectTimeout, or past the drain
+    // deadline once draining. The wake-up eventfd is polled as well, so a Drain
+    // started meanwhile shortens the wait.
+    int ConnectTo(const struct addrinfo *address)
+    {
+        int fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, address->ai_protocol);
+
+        if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            return fd;
+        }
+
+        auto connectDeadline = std::chrono::steady_clock::now() + settings.connectTimeout;
+        int error = errno;
+
+        while (error == EINPROGRESS && active && !exiting)
+        {
+            auto deadline = draining ? std::min(connectDeadline, drainDeadline) : connectDeadline;
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            struct pollfd fds[2] = {{fd, POLLOUT, 0}, {wakeUp, POLLIN, 0}};
+
+            if (timeout.count() < 0)
+            {
+                error = ETIMEDOUT;
+                break;
+            }
+
+            if (poll(fds, 2, (int)timeout.count() + 1) < 0)
+            {
+                continue;
+            }
+
+            if (fds[0].revents != 0)
+            {
+                socklen_t length = sizeof(error);
+
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+                {
+                    error = errno;
+                }
+
+                break;
+            }
+
+            if (fds[1].revents & POLLIN)
+            {
+                uint64_t count;
+
+                while (read(wakeUp, &count, sizeof(count)) > 0)
+                {
+                }
+            }
+        }
+
+        if (error == 0)
+        {
+            return fd;
+        }
+
+        close(fd);
+        errno = error == EINPROGRESS ? ECANCELED : error;
+
+        return -1;
+    }
+
+    void Connect()
+    {
+        socket = OpenSocket();
+
+        if (socket < 0)
+        {
+            ScheduleReconnect();
+
+            return;
+        }
+
+        std::string body;
+        uint8_t flags = 0;
+
+        if (!settings.username.empty())
+        {
+            flags |= 0x80;
+        }
+        if (!settings.password.empty())
+        {
+            flags |= 0x40;
+        }
+
+        AppendMqttString(body, "MQTT");
+        body += (char)settings.protocolVersion;
+        body += (char)flags;
+        AppendMqttUint16(body, settings.keepAlive.count());
+
+        if (settings.protocolVersion == 5)
+        {
+            AppendMqttLength(body, 5);
+            body += (char)MqttSessionExpiryProperty;
+            for (int shift = 24; shift >= 0; shift -= 8)
+            {
+                body += (char)(settings.sessionExpiry >> shift);
+            }
+        }
+
+        AppendMqttString(body, settings.clientId);
+
+        if (!settings.username.empty())
+        {
+            AppendMqttString(body, settings.username);
+        }
+        if (!settings.password.empty())
+        {
+            AppendMqttString(body, settings.password);
+        }
+
+        Send(MqttPacket(MqttConnect, 0, body));
+    }
+
+    void Disconnect()
+    {
+        if (socket >= 0)
+        {
+            close(socket);
+        }
+
+        socket = -1;
+        connected = false;
+        awaitingPingResponse = false;
+        received.clear();
+    }
+
+    void ScheduleReconnect()
+    {
+        Disconnect();
+
+        auto delay = std::chrono::milliseconds(1000);
+
+        for (int i = 0; i < reconnectAttempts && delay < std::chrono::minutes(1); i++)
+        {
+            delay *= 2;
+        }
+
+        delay = std::min<std::chrono::milliseconds>(delay, std::chrono::minutes(1));
+
+        std::uniform_int_distribution<long> jitter(0, delay.count() / 2);
+
+        reconnectAttempts++;
+        reconnectTime = std::chrono::steady_clock::now() + delay - std::chrono::milliseconds(jitter(random));
+        std::cout << "Reconnecting to MQTT broker after " << (reconnectTime - std::chrono::steady_clock::now()) / std::chrono::milliseconds(1) << " ms" << std::endl;
+    }
+
+    bool Send(const std::string &packet)
+    {
+        for (size_t sent = 0; socket >= 0 && sent < packet.size();)
+        {
+            auto result = send(socket, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+
+            if (result < 0 && errno != EINTR)
+            {
+                std::cerr << "Failed to send to MQTT broker: " << strerror(errno) << std::endl;
+                ScheduleReconnect();
+
+                return false;
+            }
+
+            sent += std::max<ssize_t>(0, result);
+        }
+
+        lastSendTime = std::chrono::steady_clock::now();
+
+        return socket >= 0;
+    }
+
+    uint16_t NextPacketId()
+    {
+        auto packetId = nextPacketId;
+
+        nextPacketId = nextPacketId == UINT16_MAX ? 1 : nextPacketId + 1;
+
+        return packetId;
+    }
+
+    std::string Topic(uint32_t deviceId) const
+    {
+        return settings.topicPrefix + "/" + IntToBase36(deviceId).value;
+    }
+
+    // The reading as a batch of one, as it would be posted to the API.
+    std::string Payload(const SensorSample &sample)
+    {
+        DeviceDataBatch batch;
+
+        batch.format = format;
+        batch.Add(sample.deviceId, serializer.Serialize(format, sample), sample.timestamp);
+
+        return std::string(batch.Take().Body());
+    }
+
+    void Publish(uint32_t deviceId, const std::string &topic, std::string_view payload, uint64_t outboxSegment = 0)
+    {
+        std::string body;
+
+        AppendMqttString(body, topic);
+
+        auto packetId = NextPacketId();
+
+        AppendMqttUint16(body, packetId);
+
+        if (settings.protocolVersion == 5)
+        {
+            AppendMqttLength(body, 0);
+        }
+
+        body += payload;
+
+        auto packet = MqttPacket(MqttPublish, 0x02, body); // QoS 1
+        auto payloadOffset = packet.size() - payload.size();
+
+        inFlight.push_back({packetId, deviceId, std::move(packet), payloadOffset, outboxSegment});
+        Send(inFlight.back().packet);
+    }
+
+    void Publish(const SensorSample &sample)
+    {
+        Publish(sample.deviceId, Topic(sample.deviceId), Payload(sample));
+    }
+
+    // Stores a reading in the outbox as it was published, so a replayed reading keeps
+    // its idempotency key. Returns false if it had to be dropped.
+    bool Spill(uint32_t deviceId, const std::string &topic, std::string_view payload)
+    {
+        return outbox.IsOpen() && outbox.Append(IntToBase36(deviceId).value, topic, payload, format == WireFormat::Cbor ? 2 : 0, 0);
+    }
+
+    bool Spill(const SensorSample &sample)
+    {
+        return Spill(sample.deviceId, Topic(sample.deviceId), Payload(sample));
+    }
+
+    // Sends all alarms, then readings stored in the outbox and then readings from the
+    // backlog until maxInFlight wait for their PUBACK. Nothing is read back from the
+    // outbox while draining.
+    void Publish()
+    {
+        while (auto sample = incoming.TryPop())
+        {
+            backlog.Add(*sample);
+        }
+
+        while (backlog.IsOverBudget())
+        {
+            backlog.EvictOldest();
+            droppedMessages++;
+        }
+
+        while (connected)
+        {
+            auto alarm = incomingAlarms.TryPop();
+
+            if (!alarm)
+            {
+                break;
+            }
+
+            Publish(*alarm);
+        }
+
+        while (connected && inFlight.size() < settings.maxInFlight && outbox.IsOpen() && !draining)
+        {
+            auto record = outbox.Next();
+
+            if (!record)
+            {
+                break;
+            }
+
+            Publish(OrderingKeyFromOutbox(*record), record->path, record->content, record->segment);
+        }
+
+        while (connected && inFlight.size() < settings.maxInFlight)
+        {
+            auto next = backlog.Take(time(NULL));
+
+            if (!next)
+            {
+                break;
+            }
+
+            Publish(*next);
+        }
+
+        droppedMessages += backlog.TakeShedReadings();
+
+        size_t dropped = droppedMessages;
+
+        if (dropped != reportedDroppedMessages)
+        {
+            std::cerr << "MQTT backlog full, dropped " << dropped - reportedDroppedMessages << " messages" << std::endl;
+            reportedDroppedMessages = dropped;
+        }
+    }
+
+    void OnConnAck(const std::string &body)
+    {
+        if (body.size() < 2 || body[1] != 0)
+        {
+            std::cerr << "MQTT broker refused the connection with code " << (body.size() < 2 ? -1 : (uint8_t)body[1]) << std::endl;
+            ScheduleReconnect();
+
+            return;
+        }
+
+        bool sessionPresent = body[0] & 0x01;
+
+        std::cout << "Connected to MQTT broker " << settings.host << (sessionPresent ? ", session resumed" : "") << std::endl;
+        connected = true;
+        reconnectAttempts = 0;
+
+        for (auto &message : inFlight)
+        {
+            message.packet[0] |= 0x08; // DUP
+
+            if (!Send(message.packet))
+            {
+                return;
+            }
+        }
+    }
+
+    void OnPubAck(const std::string &body)
+    {
+        if (body.size() < 2)
+        {
+            return;
+        }
+
+        uint16_t packetId = (uint8_t)body[0] << 8 | (uint8_t)body[1];
+
+        for (auto message = inFlight.begin(); message != inFlight.end(); message++)
+        {
+            if (message->packetId == packetId)
+            {
+                // A reading read back from the outbox stays there until acknowledged
+                if (message->outboxSegment != 0)
+                {
+                    outbox.Done(message->outboxSegment);
+                }
+
+                inFlight.erase(message);
+                break;
+            }
+        }
+
+        if (body.size() > 2 && (uint8_t)body[2] >= 0x80)
+        {
+            std::cerr << "MQTT broker rejected a message with reason code " << (int)(uint8_t)body[2] << std::endl;
+        }
+    }
+
+    // Handles the complete packets received so far.
+    void Receive()
+    {
+        char chunk[4096];
+        auto result = recv(socket, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+        if (result == 0 || (result < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            std::cerr << "Connection to MQTT broker lost" << std::endl;
+            ScheduleReconnect();
+
+            return;
+        }
+
+        received.append(chunk, std::max<ssize_t>(0, result));
+
+        while (socket >= 0)
+        {
+            size_t length = 0;
+            size_t position = 1;
+            bool lengthComplete = false;
+
+            for (int shift = 0; position < received.size() && shift < 28 && !lengthComplete; shift += 7)
+            {
+                uint8_t digit = received[position++];
+
+                length |= (size_t)(digit & 0x7F) << shift;
+                lengthComplete = (digit & 0x80) == 0;
+            }
+
+            if (!lengthComplete || received.size() - position < length)
+            {
+                return;
+            }
+
+            auto type = (uint8_t)received[0] >> 4;
+            auto body = received.substr(position, length);
+
+            received.erase(0, position + length);
+
+            if (type == MqttConnAck)
+            {
+                OnConnAck(body);
+            }
+            else if (type == MqttPubAck)
+            {
+                OnPubAck(body);
+            }
+            else if (type == MqttPingResp)
+            {
+                awaitingPingResponse = false;
+            }
+            else if (type == MqttDisconnect)
+            {
+                std::cerr << "MQTT broker closed the connection" << std::endl;
+                ScheduleReconnect();
+            }
+        }
+    }
+
+    // Pings the broker when nothing was sent for keepAlive and reconnects when the
+    // ping is not answered within another keepAlive. Returns when to check next.
+    TimePoint KeepAlive(TimePoint now)
+    {
+        auto deadline = lastSendTime + settings.keepAlive;
+
+        if (now < deadline)
+        {
+            return deadline;
+        }
+
+        if (awaitingPingResponse)
+        {
+            std::cerr << "MQTT broker did not answer a ping" << std::endl;
+            ScheduleReconnect();
+
+            return reconnectTime;
+        }
+
+        awaitingPingResponse = true;
+        Send(MqttPacket(MqttPingReq, 0, std::string()));
+
+        return now + settings.keepAlive;
+    }
+
+    // While draining: true once the broker has acknowledged every reading, or when
+    // nothing more can be published before the deadline.
+    bool IsDrained(TimePoint now)
+    {
+        if (!draining)
+        {
+            return false;
+        }
+
+        if (now >= drainDeadline || (socket < 0 && reconnectTime >= drainDeadline))
+        {
+            return true;
+        }
+
+        return connected && inFlight.empty() && backlog.IsEmpty();
+    }
+
+    // Stores the readings the broker has not acknowledged at the end of a drain in
+    // the outbox, those in flight first, for the next start to publish. Readings in
+    // flight may have reached the broker, subscribers drop the copies by their
+    // idempotency keys. Readings read back from the outbox are still stored there.
+    void SpillUnpublished()
+    {
+        size_t lost = 0;
+
+        for (auto &message : inFlight)
+        {
+            auto payload = std::string_view(message.packet).substr(message.payloadOffset);
+
+            if (message.outboxSegment == 0 && !Spill(message.deviceId, Topic(message.deviceId), payload))
+            {
+                lost++;
+            }
+        }
+
+        inFlight.clear();
+
+        while (auto alarm = incomingAlarms.TryPop())
+        {
+            lost += Spill(*alarm) ? 0 : 1;
+        }
+
+        while (auto sample = backlog.Take(time(NULL)))
+        {
+            lost += Spill(*sample) ? 0 : 1;
+        }
+
+        if (outbox.IsOpen() && !outbox.Sync())
+        {
+            std::cerr << "Shutting down, the MQTT outbox could not be written, its readings are lost" << std::endl;
+        }
+
+        if (lost > 0)
+        {
+            std::cerr << "Shutting down, " << lost << " readings were not acknowledged by the MQTT broker and could not be stored" << std::endl;
+        }
+    }
+
+    static void Worker(MqttPublisher *self)
+    {
+        while (self->active && !exiting)
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            if (self->socket < 0 && now >= self->reconnectTime)
+            {
+                self->Connect();
+            }
+
+            self->Publish();
+
+            if (self->IsDrained(now))
+            {
+                self->SpillUnpublished();
+                break;
+            }
+
+            auto wakeUpTime = self->socket >= 0 ? self->KeepAlive(now) : self->reconnectTime;
+
+            if (self->draining)
+            {
+                wakeUpTime = std::min(wakeUpTime, self->drainDeadline);
+            }
+
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wakeUpTime - now);
+            struct pollfd fds[2] = {{self->wakeUp, POLLIN, 0}, {self->socket, POLLIN, 0}};
+
+            if (poll(fds, self->socket >= 0 ? 2 : 1, (int)std::max(0L, (long)timeout.count())) < 0)
+            {
+                continue;
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                uint64_t count;
+
+                while (read(self->wakeUp, &count, sizeof(count)) > 0)
+                {
+                }
+            }
+
+            if (self->socket >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                self->Receive();
+            }
+        }
+
+        if (self->connected)
+        {
+            self->Send(MqttPacket(MqttDisconnect, 0, std::string()));
+        }
+    }
+};
@@ -0,0 +1,534 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A request kept on disk until it can be delivered.
+struct OutboxRecord
+{
+    std::string orderingKey;
+    std::string path;
+    std::string content;
+    uint8_t flags; // stored for the caller, not interpreted by the outbox
+    uint32_t timeout;
+    uint64_t segment; // set by Outbox::Next, pass back to Outbox::Done
+};
+
+struct OutboxSettings
+{
+    std::string directory;
+    size_t segmentBytes;
+    size_t maxBytes;
+    size_t syncBytes;
+    std::chrono::milliseconds syncInterval;
+};
+
+// Append-only store for requests that cannot be delivered right now. Records are
+// written to numbered segment files, each record prefixed with its size and a CRC32
+// of its payload. Appends are buffered and written with one fdatasync once syncBytes
+// have collected or the oldest unsynced record is syncInterval old. Segments are read
+// back oldest first through a read-only mapping and a segment is deleted once every
+// record read from it is done. A segment that is still on disk after a restart is
+// replayed from the start, so a record may be delivered more than once.
+//
+// Not thread safe, the uploader worker is the only user.
+class Outbox
+{
+public:
+    Outbox()
+        : opened(false), writeFd(-1), lastSegment(0), writeSegment(0), writeSegmentBytes(0), totalBytes(0),
+          readSegment(0), readMapping(nullptr), readSize(0), readOffset(0)
+    {
+    }
+
+    Outbox(const Outbox &) = delete;
+    Outbox &operator=(const Outbox &) = delete;
+
+    ~Outbox()
+    {
+        Sync();
+        CloseWriteSegment();
+        CloseReadSegment();
+    }
+
+    bool Open(const OutboxSettings &outboxSettings)
+    {
+        settings = outboxSettings;
+        opened = false;
+
+        if (mkdir(settings.directory.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            std::cerr << "Could not create outbox directory " << settings.directory << ": " << strerror(errno) << std::endl;
+
+            return false;
+        }
+
+        auto directory = opendir(settings.directory.c_str());
+
+        if (directory == NULL)
+        {
+            std::cerr << "Could not open outbox directory " << settings.directory << ": " << strerror(errno) << std::endl;
+
+            return false;
+        }
+
+        while (auto entry = readdir(directory))
+        {
+            uint64_t segment = 0;
+            char suffix[8] = {0};
+
+            if (sscanf(entry->d_name, "%16" SCNx64 ".%7s", &segment, suffix) == 2 && strcmp(suffix, "seg") == 0 && segment > 0)
+            {
+                segments.push_back(segment);
+                lastSegment = std::max(lastSegment, segment);
+                totalBytes += FileSize(SegmentPath(segment));
+            }
+        }
+
+        closedir(directory);
+
+        std::sort(segments.begin(), segments.end());
+
+        if (!segments.empty())
+        {
+            std::cout << "Outbox has " << segments.size() << " segments (" << totalBytes << " bytes) to deliver" << std::endl;
+        }
+
+        opened = true;
+
+        return true;
+    }
+
+    bool IsOpen() const
+    {
+        return opened;
+    }
+
+    bool HasBacklog() const
+    {
+        return readMapping != nullptr || !segments.empty() || !writeBuffer.empty();
+    }
+
+    bool Append(const std::string &orderingKey, const std::string &path, std::string_view content, uint8_t flags, uint32_t timeout)
+    {
+        auto payloadSize = 1 + 4 + 2 + 2 + orderingKey.size() + path.size() + content.size();
+
+        if (!opened || orderingKey.size() > UINT16_MAX || path.size() > UINT16_MAX || payloadSize > UINT32_MAX || !MakeRoom(payloadSize + 8))
+        {
+            return false;
+        }
+
+        if (writeBuffer.empty())
+        {
+            firstUnsyncedTime = std::chrono::steady_clock::now();
+        }
+
+        auto recordStart = writeBuffer.size();
+
+        AppendValue(writeBuffer, (uint32_t)payloadSize);
+        AppendValue(writeBuffer, (uint32_t)0);
+        AppendValue(writeBuffer, flags);
+        AppendValue(writeBuffer, timeout);
+        AppendValue(writeBuffer, (uint16_t)orderingKey.size());
+        AppendValue(writeBuffer, (uint16_t)path.size());
+        writeBuffer += orderingKey;
+        writeBuffer += path;
+        writeBuffer += content;
+
+        auto payload = (const Bytef *)writeBuffer.data() + recordStart + 8;
+        uint32_t checksum = crc32(0L, payload, (uInt)payloadSize);
+
+        memcpy(&writeBuffer[recordStart + 4], &checksum, sizeof(checksum));
+        totalBytes += payloadSize + 8;
+
+        if (writeBuffer.size() >= settings.syncBytes)
+        {
+            Sync();
+        }
+
+        return true;
+    }
+
+    // Writes out buffered records if they have waited for syncInterval and returns
+    // when this has to be checked again.
+    std::chrono::steady_clock::time_point SyncIfDue(std::chrono::steady_clock::time_point now)
+    {
+        if (writeBuffer.empty())
+        {
+            return std::chrono::steady_clock::time_point::max();
+        }
+
+        if (firstUnsyncedTime + settings.syncInterval <= now)
+        {
+            Sync();
+
+            return std::chrono::steady_clock::time_point::max();
+        }
+
+        return firstUnsyncedTime + settings.syncInterval;
+    }
+
+    // Writes out the buffered records, returns false if they are still buffered
+    // because the segment could not be written. A failed write is cut off the
+    // segment and the records stay in the buffer, still counted against maxBytes,
+    // so Append drops new requests once the disk has been failing for too long.
+    bool Sync()
+    {
+        if (writeBuffer.empty())
+        {
+            return true;
+        }
+
+        if (writeFd < 0 || writeSegmentBytes >= settings.segmentBytes)
+        {
+            OpenWriteSegment();
+        }
+
+        size_t written = 0;
+
+        while (writeFd >= 0 && written < writeBuffer.size())
+        {
+            auto result = write(writeFd, writeBuffer.data() + written, writeBuffer.size() - written);
+
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (result < 0)
+            {
+                std::cerr << "Writing outbox segment failed, keeping " << writeBuffer.size() << " bytes buffered: " << strerror(errno) << std::endl;
+                DiscardWriteSegmentTail();
+
+                return false;
+            }
+
+            written += result;
+        }
+
+        if (writeFd < 0)
+        {
+            return false;
+        }
+
+        if (fdatasync(writeFd) != 0)
+        {
+            std::cerr << "Syncing outbox segment failed, keeping " << writeBuffer.size() << " bytes buffered: " << strerror(errno) << std::endl;
+            DiscardWriteSegmentTail();
+
+            return false;
+        }
+
+        writeSegmentBytes += written;
+        writeBuffer.clear();
+
+        return true;
+    }
+
+    // Returns the next record to deliver, oldest first.
+    std::optional<OutboxRecord> Next()
+    {
+        while (readMapping != nullptr || OpenReadSegment())
+        {
+            auto record = ReadRecord();
+
+            if (record)
+            {
+                replaying[readSegment]++;
+
+                return record;
+            }
+
+            auto segment = readSegment;
+
+            CloseReadSegment();
+            RemoveIfDone(segment);
+        }
+
+        return std::nullopt;
+    }
+
+    // Called once a record returned by Next is delivered or appended again.
+    void Done(uint64_t segment)
+    {
+        auto replayed = replaying.find(segment);
+
+        if (replayed != replaying.end() && replayed->second > 0)
+        {
+            replayed->second--;
+            RemoveIfDone(segment);
+        }
+    }
+
+private:
+    template <typename T>
+    static void AppendValue(std::string &buffer, T value)
+    {
+        buffer.append((const char *)&value, sizeof(value));
+    }
+
+    template <typename T>
+    T ReadValue(size_t offset) const
+    {
+        T value;
+
+        memcpy(&value, readMapping + offset, sizeof(value));
+
+        return value;
+    }
+
+    static size_t FileSize(const std::string &path)
+    {
+        struct stat status;
+
+        return stat(path.c_str(), &status) == 0 ? status.st_size : 0;
+    }
+
+    std::string SegmentPath(uint64_t segment) const
+    {
+        char name[32];
+
+        snprintf(name, sizeof(name), "/%016" PRIx64 ".seg", segment);
+
+        return settings.directory + name;
+    }
+
+    void OpenWriteSegment()
+    {
+        CloseWriteSegment();
+
+        writeSegment = ++lastSegment;
+        writeSegmentBytes = 0;
+        writeFd = open(SegmentPath(writeSegment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (writeFd < 0)
+        {
+            std::cerr << "Could not open outbox segment: " << strerror(errno) << std::endl;
+
+            return;
+        }
+
+        segments.push_back(writeSegment);
+    }
+
+    void CloseWriteSegment()
+    {
+        if (writeFd >= 0)
+        {
+            close(writeFd);
+            writeFd = -1;
+        }
+    }
+
+    // Cuts what the failed Sync wrote off the segment and closes it, the next Sync
+    // starts a new one. An empty segment is removed.
+    void DiscardWriteSegmentTail()
+    {
+        if (ftruncate(writeFd, writeSegmentBytes) != 0)
+        {
+            std::cerr << "Could not truncate outbox segment: " << strerror(errno) << std::endl;
+        }
+
+        CloseWriteSegment();
+
+        if (writeSegmentBytes == 0 && !segments.empty() && segments.back() == writeSegment)
+        {
+            unlink(SegmentPath(writeSegment).c_str());
+            segments.pop_back();
+        }
+    }
+
+    bool OpenReadSegment()
+    {
+        if (segments.empty())
+        {
+            if (writeBuffer.empty() || !Sync())
+            {
+                return false;
+            }
+        }
+
+        if (segments.empty())
+        {
+            return false;
+        }
+
+        // The segment being written is sealed before it is read, appends go to a new one
+        if (segments.front() == writeSegment && writeFd >= 0)
+        {
+            if (!Sync())
+            {
+                return false;
+            }
+
+            CloseWriteSegment();
+        }
+
+        readSegment = segments.front();
+        segments.pop_front();
+
+        auto path = SegmentPath(readSegment);
+        auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat status;
+
+        replaying.emplace(readSegment, 0);
+
+        if (fd < 0 || fstat(fd, &status) != 0 || status.st_size == 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            readMapping = nullptr;
+            readSize = 0;
+
+            return true;
+        }
+
+        auto mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "Could not map outbox segment " << path << ": " << strerror(errno) << std::endl;
+            readMapping = nullptr;
+            readSize = 0;
+
+            return true;
+        }
+
+        madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+        readMapping = (const uint8_t *)mapping;
+        readSize = status.st_size;
+        readOffset = 0;
+
+        return true;
+    }
+
+    void CloseReadSegment()
+    {
+        if (readMapping != nullptr)
+        {
+            munmap((void *)readMapping, readSize);
+        }
+
+        readMapping = nullptr;
+        readSize = 0;
+        readOffset = 0;
+    }
+
+    std::optional<OutboxRecord> ReadRecord()
+    {
+        if (readMapping == nullptr || readOffset + 8 > readSize)
+        {
+            return std::nullopt;
+        }
+
+        auto payloadSize = ReadValue<uint32_t>(readOffset);
+        auto checksum = ReadValue<uint32_t>(readOffset + 4);
+        auto payload = readOffset + 8;
+
+        // A torn or corrupted record ends the segment, nothing after it can be trusted
+        if (payloadSize < 9 || payload + payloadSize > readSize || crc32(0L, readMapping + payload, payloadSize) != checksum)
+        {
+            std::cerr << "Outbox segment " << readSegment << " is damaged at offset " << readOffset << ", skipping the rest of it" << std::endl;
+
+            return std::nullopt;
+        }
+
+        auto keySize = ReadValue<uint16_t>(payload + 5);
+        auto pathSize = ReadValue<uint16_t>(payload + 7);
+
+        if (9 + (size_t)keySize + pathSize > payloadSize)
+        {
+            return std::nullopt;
+        }
+
+        auto strings = (const char *)readMapping + payload + 9;
+        OutboxRecord record = {
+            std::string(strings, keySize),
+            std::string(strings + keySize, pathSize),
+            std::string(strings + keySize + pathSize, payloadSize - 9 - keySize - pathSize),
+            ReadValue<uint8_t>(payload),
+            ReadValue<uint32_t>(payload + 1),
+            readSegment};
+
+        readOffset = payload + payloadSize;
+
+        return record;
+    }
+
+    void RemoveIfDone(uint64_t segment)
+    {
+        auto replayed = replaying.find(segment);
+
+        if (replayed == replaying.end() || replayed->second > 0 || (segment == readSegment && readMapping != nullptr))
+        {
+            return;
+        }
+
+        Remove(segment);
+        replaying.erase(replayed);
+    }
+
+    void Remove(uint64_t segment)
+    {
+        auto path = SegmentPath(segment);
+        auto size = FileSize(path);
+
+        unlink(path.c_str());
+        totalBytes -= std::min(totalBytes, size);
+    }
+
+    // Drops the oldest unread segments until size more bytes fit under maxBytes.
+    bool MakeRoom(size_t size)
+    {
+        while (totalBytes + size > settings.maxBytes)
+        {
+            if (segments.empty() || segments.front() == writeSegment)
+            {
+                std::cerr << "Outbox full, dropping request" << std::endl;
+
+                return false;
+            }
+
+            std::cerr << "Outbox full, dropping segment " << segments.front() << std::endl;
+            Remove(segments.front());
+            segments.pop_front();
+        }
+
+        return true;
+    }
+
+    OutboxSettings settings;
+    bool opened;
+    std::deque<uint64_t> segments; // unread segments, oldest first, including the one being written
+    std::map<uint64_t, size_t> replaying; // read segments and their records not done yet
+    std::string writeBuffer;
+    std::chrono::steady_clock::time_point firstUnsyncedTime;
+    int writeFd;
+    uint64_t lastSegment;
+    uint64_t writeSegment;
+    size_t writeSegmentBytes;
+    size_t totalBytes;
+    uint64_t readSegment;
+    const uint8_t *readMapping;
+    size_t readSize;
+    size_t readOffset;
+};
@@ -0,0 +1,103 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <optional>
+
+// Bounded lock-free queue for many producers and a single consumer. Producers never
+// wait: TryPush fails when the queue is full so the caller can apply backpressure.
+// Based on Dmitry Vyukov's bounded MPMC queue with the consumer side simplified.
+template <typename T>
+class BoundedMpscQueue
+{
+public:
+    explicit BoundedMpscQueue(size_t capacity)
+        : cells(new Cell[RoundUpToPowerOfTwo(capacity)]),
+          mask(RoundUpToPowerOfTwo(capacity) - 1),
+          enqueuePosition(0),
+          dequeuePosition(0)
+    {
+        for (size_t i = 0; i <= mask; i++)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpscQueue(const BoundedMpscQueue &) = delete;
+    BoundedMpscQueue &operator=(const BoundedMpscQueue &) = delete;
+
+    bool TryPush(T &&value)
+    {
+        auto position = enqueuePosition.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            auto &cell = cells[position & mask];
+            auto difference = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)position;
+
+            if (difference == 0)
+            {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.value.emplace(std::move(value));
+                    cell.sequence.store(position + 1, std::memory_order_release);
+
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Must only be called from the consumer thread.
+    std::optional<T> TryPop()
+    {
+        auto &cell = cells[dequeuePosition & mask];
+        auto difference = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)(dequeuePosition + 1);
+
+        if (difference < 0)
+        {
+            return std::nullopt;
+        }
+
+        std::optional<T> value = std::move(cell.value);
+
+        cell.value.reset();
+        cell.sequence.store(dequeuePosition + mask + 1, std::memory_order_release);
+        dequeuePosition++;
+
+        return value;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        std::optional<T> value;
+    };
+
+    static size_t RoundUpToPowerOfTwo(size_t value)
+    {
+        size_t result = 2;
+
+        while (result < value)
+        {
+            result <<= 1;
+        }
+
+        return result;
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePosition;
+    alignas(64) size_t dequeuePosition;
+};
@@ -0,0 +1,201 @@
+#include <Tarts.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <unordered_map>
+
+// Static description of the sensor types the gateway knows how to register
+// and how their datums are reported to the jottai agent. Adding support for a
+// new sensor type is a single entry in SupportedSensorTypes.
+
+typedef TartsSensorBase *(*SensorFactory)(const char *sensorID);
+
+// When a reading of the sensor type is an alarm rather than routine telemetry.
+enum class AlarmOn : uint8_t
+{
+    Never,
+    Change, // a datum value differs from the previous reading of the sensor
+    Always  // every reading reports an event, such as a button press
+};
+
+struct DatumInfo
+{
+    const char *propertyType; // nullptr: the datum name is used as is
+    const char *valueType;
+    float divisor;            // 0: the raw value is passed through unscaled
+};
+
+struct SensorTypeInfo
+{
+    uint16_t type;
+    SensorFactory create;
+    const char *name;
+    uint8_t datumCount;
+    DatumInfo datums[2];
+    AlarmOn alarmOn;
+};
+
+template <typename TSensor>
+TartsSensorBase *CreateSensorOf(const char *sensorID)
+{
+    return TSensor::Create(sensorID);
+}
+
+constexpr DatumInfo IntegerDatum = {nullptr, "Integer", 0};
+constexpr DatumInfo TemperatureDatum = {"Temperature", "Decimal", 10};
+constexpr DatumInfo HumidityTemperatureDatum = {"Temperature", "Decimal", 100};
+constexpr DatumInfo RelativeHumidityDatum = {"RelativeHumidity", "Decimal", 100};
+constexpr DatumInfo ContactDatum = {"Contact", "Integer", 0};
+constexpr DatumInfo PresenceOfWaterDatum = {"PresenceOfWater", "Integer", 0};
+constexpr DatumInfo MotionDatum = {"Motion", "Integer", 0};
+
+// Datum order follows the DatumList order produced by the sensor's _parseData.
+constexpr SensorTypeInfo SupportedSensorTypes[] = {
+    {Measure1VDC, CreateSensorOf<TartsMeasure1VDC>, "1 VDC Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Temperature, CreateSensorOf<TartsTemperature>, "Temperature Sensor", 1, {TemperatureDatum}, AlarmOn::Never},
+    {DryContact, CreateSensorOf<TartsDryContact>, "Dry Contact Sensor", 1, {ContactDatum}, AlarmOn::Never},
+    {WaterDetect, CreateSensorOf<TartsWaterDetect>, "Water Detection Sensor", 1, {PresenceOfWaterDatum}, AlarmOn::Change},
+    {Activity, CreateSensorOf<TartsActivity>, "Activity Sensor", 1, {MotionDatum}, AlarmOn::Never},
+    {OpenClose, CreateSensorOf<TartsOpenClose>, "Open Close Sensor", 1, {ContactDatum}, AlarmOn::Change},
+    {Button, CreateSensorOf<TartsButton>, "Button Sensor", 1, {IntegerDatum}, AlarmOn::Always},
+    {Measure20mA, CreateSensorOf<TartsMeasure20mA>, "20 mA Current Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {PassiveIR, CreateSensorOf<TartsPassiveIR>, "Passive IR Sensor", 1, {MotionDatum}, AlarmOn::Change},
+    {Compass, CreateSensorOf<TartsCompass>, "Compass Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Measure500VAC, CreateSensorOf<TartsMeasure500VAC>, "500 VAC Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Humidity, CreateSensorOf<TartsHumidity>, "Humidity Sensor", 2, {RelativeHumidityDatum, HumidityTemperatureDatum}, AlarmOn::Never},
+    {Measure50VDC, CreateSensorOf<TartsMeasure50VDC>, "50 VDC Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {VACDetect, CreateSensorOf<TartsVACDetect>, "VAC Detect Sensor", 1, {PresenceOfWaterDatum}, AlarmOn::Never},
+    {WaterTemperature, CreateSensorOf<TartsWaterTemperature>, "Water Temperature Sensor", 1, {TemperatureDatum}, AlarmOn::Never},
+    {Asset, CreateSensorOf<TartsAsset>, "Assets Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Resistance, CreateSensorOf<TartsResistance>, "Resistance Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {VDCDetect, CreateSensorOf<TartsVDCDetect>, "VDC Detect Sensor", 1, {PresenceOfWaterDatum}, AlarmOn::Never},
+    {Measure5VDC, CreateSensorOf<TartsMeasure5VDC>, "5 VDC Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Measure10VDC, CreateSensorOf<TartsMeasure10VDC>, "10 VDC Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {Tilt, CreateSensorOf<TartsTilt>, "Tilt Sensor", 2, {IntegerDatum, IntegerDatum}, AlarmOn::Never},
+    {BasicControl, CreateSensorOf<TartsBasicControl>, "Basic Control Sensor", 1, {IntegerDatum}, AlarmOn::Never},
+    {WaterRope, CreateSensorOf<TartsWaterRope>, "Water Rope Sensor", 1, {PresenceOfWaterDatum}, AlarmOn::Change},
+};
+
+constexpr uint16_t MaxSupportedSensorType()
+{
+    uint16_t max = 0;
+
+    for (const auto &sensorType : SupportedSensorTypes)
+    {
+        if (sensorType.type > max)
+        {
+            max = sensorType.type;
+        }
+    }
+
+    return max;
+}
+
+typedef std::array<SensorTypeInfo, MaxSupportedSensorType() + 1> SensorTypeTable;
+
+constexpr SensorTypeTable BuildSensorTypeTable()
+{
+    SensorTypeTable table{};
+
+    for (const auto &sensorType : SupportedSensorTypes)
+    {
+        table[sensorType.type] = sensorType;
+    }
+
+    return table;
+}
+
+constexpr SensorTypeTable SensorTypes = BuildSensorTypeTable();
+
+const SensorTypeInfo *FindSensorType(uint16_t type)
+{
+    if (type >= SensorTypes.size() || SensorTypes[type].create == nullptr)
+    {
+        return nullptr;
+    }
+
+    return &SensorTypes[type];
+}
+
+const DatumInfo &FindDatumInfo(uint16_t type, int datumIndex)
+{
+    auto sensorType = FindSensorType(type);
+
+    if (sensorType == nullptr || datumIndex >= sensorType->datumCount)
+    {
+        return IntegerDatum;
+    }
+
+    return sensorType->datums[datumIndex];
+}
+
+// Captures a sensor message as a SensorSample. Values are parsed but nothing is
+// formatted, that is left to the sink.
+SensorSample MakeSensorSample(uint32_t gatewayId, const SensorMessage *msg, time_t timestamp, uint32_t sequence)
+{
+    SensorSample sample = {};
+
+    sample.gatewayId = gatewayId;
+    sample.deviceId = Base36ArrayToInt(msg->ID);
+    sample.timestamp = timestamp;
+    sample.sequence = sequence;
+    sample.sensorType = msg->SensorType;
+    sample.batteryVoltage = msg->BatteryVoltage;
+    sample.rssi = msg->RSSI;
+    sample.datumCount = std::min<int>(std::max<int>(msg->DatumCount, 0), SensorSampleMaxDatums);
+
+    for (int i = 0; i < sample.datumCount; i++)
+    {
+        auto &datum = sample.datums[i];
+        auto value = msg->DatumList[i].Value;
+        auto result = std::from_chars(value, value + strlen(value), datum.value);
+
+        datum.name = msg->DatumList[i].Name;
+
+        if (result.ec == std::errc() && result.ptr != value)
+        {
+            sample.numberDatums |= 1 << i;
+        }
+    }
+
+    return sample;
+}
+
+// Classifies samples by the alarmOn of their sensor type. Remembers the datum
+// values of the last sample of each alarm sensor, the first sample after start
+// counts as a change. Not thread safe, used from the thread running Tarts.Process.
+class AlarmDetector
+{
+public:
+    DeviceDataPriority Classify(const SensorSample &sample)
+    {
+        auto sensorType = FindSensorType(sample.sensorType);
+
+        if (sensorType == nullptr || sensorType->alarmOn == AlarmOn::Never)
+        {
+            return DeviceDataPriority::Telemetry;
+        }
+
+        std::array<int64_t, SensorSampleMaxDatums> current;
+
+        current.fill(INT64_MIN);
+        for (int i = 0; i < sample.datumCount; i++)
+        {
+            current[i] = sample.IsNumber(i) ? sample.datums[i].value : INT64_MAX;
+        }
+
+        auto previous = states.find(sample.deviceId);
+        bool changed = previous == states.end() || previous->second != current;
+
+        states[sample.deviceId] = current;
+
+        return changed || sensorType->alarmOn == AlarmOn::Always ? DeviceDataPriority::Alarm : DeviceDataPriority::Telemetry;
+    }
+
+private:
+    std::unordered_map<uint32_t, std::array<int64_t, SensorSampleMaxDatums>> states;
+};
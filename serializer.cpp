@@ -0,0 +1,290 @@
+#include <Tarts.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Writes device-data documents for the jottai agent from sensor samples. Everything
+// that does not change between readings of a sensor is serialized once: the gateway
+// and device IDs on the first sample of the sensor and the property fields of each
+// datum on its first reading. Per reading only the battery voltage, RSSI, timestamp,
+// idempotency key and values are written, into a buffer that is reused from one reading to the next.
+// Readings are written as JSON or as CBOR in the layout described at
+// DeviceDataBatchSettings.
+//
+// Not thread safe, each sink serializes on its worker thread with its own instance.
+class DeviceDataSerializer
+{
+public:
+    DeviceDataSerializer()
+        : timestampTime(-1)
+    {
+    }
+
+    // The returned document is valid until the next call.
+    const std::string &Serialize(WireFormat format, const SensorSample &sample)
+    {
+        auto &sensor = SensorTemplateFor(sample);
+
+        buffer.clear();
+
+        if (format == WireFormat::Cbor)
+        {
+            SerializeCbor(sensor, sample);
+        }
+        else
+        {
+            SerializeJson(sensor, sample);
+        }
+
+        return buffer;
+    }
+
+private:
+    struct DatumTemplate
+    {
+        std::string name;
+        const DatumInfo *info;
+        std::string head; // everything up to the value
+        int exponent;     // info->divisor as a power of ten
+        bool decimal;     // the divisor is a power of ten, the value a decimal fraction
+    };
+
+    struct SensorTemplate
+    {
+        uint32_t gatewayId;
+        std::string head;     // everything up to the battery voltage
+        std::string cborHead; // gateway and device IDs
+        std::string keyHead;  // gateway and device IDs of the idempotency key
+        std::vector<DatumTemplate> datums;
+    };
+
+    SensorTemplate &SensorTemplateFor(const SensorSample &sample)
+    {
+        auto sensor = sensors.find(sample.deviceId);
+
+        if (sensor != sensors.end() && sensor->second.gatewayId == sample.gatewayId)
+        {
+            return sensor->second;
+        }
+
+        auto &added = sensors[sample.deviceId];
+
+        added.gatewayId = sample.gatewayId;
+        added.head.clear();
+        added.head += "{\"gatewayId\":\"";
+        added.head += IntToBase36(sample.gatewayId).value;
+        added.head += "\",\"deviceId\":\"";
+        added.head += IntToBase36(sample.deviceId).value;
+        added.head += "\",\"batteryVoltage\":\"";
+        added.keyHead.clear();
+        added.keyHead += IntToBase36(sample.gatewayId).value;
+        added.keyHead += '-';
+        added.keyHead += IntToBase36(sample.deviceId).value;
+        added.keyHead += '-';
+        added.cborHead.clear();
+        AppendCborHead(added.cborHead, CborUnsigned, sample.gatewayId);
+        AppendCborHead(added.cborHead, CborUnsigned, sample.deviceId);
+        added.datums.clear();
+
+        return added;
+    }
+
+    // Everything of the reading after the array head and timestamp added by the batch.
+    void SerializeCbor(SensorTemplate &sensor, const SensorSample &sample)
+    {
+        buffer += sensor.cborHead;
+        AppendCborHead(buffer, CborUnsigned, sample.sensorType);
+        AppendCborHead(buffer, CborUnsigned, sample.batteryVoltage);
+        AppendCborInteger(buffer, sample.rssi);
+        AppendCborHead(buffer, CborArray, sample.datumCount);
+
+        for (int i = 0; i < sample.datumCount; i++)
+        {
+            auto &datum = DatumTemplateFor(sensor, sample, i);
+            auto raw = sample.datums[i].value;
+
+            if (!sample.IsNumber(i))
+            {
+                buffer += (char)CborNull;
+            }
+            else if (datum.info->divisor == 0)
+            {
+                AppendCborInteger(buffer, raw);
+            }
+            else if (datum.decimal)
+            {
+                AppendCborDecimal(buffer, raw, datum.exponent);
+            }
+            else
+            {
+                AppendCborFloat(buffer, raw / datum.info->divisor);
+            }
+        }
+
+        AppendCborHead(buffer, CborUnsigned, sample.sequence);
+    }
+
+    void SerializeJson(SensorTemplate &sensor, const SensorSample &sample)
+    {
+        buffer += sensor.head;
+        AppendInteger(sample.batteryVoltage / 100);
+        buffer += '.';
+        AppendInteger(sample.batteryVoltage % 100, 2);
+        buffer += "\",\"rssi\":\"";
+        AppendInteger(sample.rssi);
+        buffer += "\",\"timestamp\":\"";
+        buffer += Timestamp(sample.timestamp);
+        buffer += "\",\"idempotencyKey\":\"";
+        buffer += sensor.keyHead;
+        AppendInteger(sample.timestamp);
+        buffer += '-';
+        AppendInteger(sample.sequence);
+        buffer += "\",\"protocol\":\"NotSpecified\",\"data\":[";
+
+        for (int i = 0; i < sample.datumCount; i++)
+        {
+            auto &datum = DatumTemplateFor(sensor, sample, i);
+
+            if (i != 0)
+            {
+                buffer += ',';
+            }
+
+            buffer += datum.head;
+            AppendValue(sample.datums[i].value, sample.IsNumber(i), datum);
+            buffer += "\"}";
+        }
+
+        buffer += "]}";
+    }
+
+    const DatumTemplate &DatumTemplateFor(SensorTemplate &sensor, const SensorSample &sample, int index)
+    {
+        const char *name = sample.datums[index].name;
+
+        if ((size_t)index < sensor.datums.size() && sensor.datums[index].name == name)
+        {
+            return sensor.datums[index];
+        }
+
+        const DatumInfo &info = FindDatumInfo(sample.sensorType, index);
+        const char *propertyType = info.propertyType != nullptr ? info.propertyType : name;
+        DatumTemplate datum = {name, &info, std::string(), 0, info.divisor >= 1};
+
+        for (float divisor = info.divisor; divisor > 1 && datum.decimal; divisor /= 10)
+        {
+            datum.decimal = (long)divisor % 10 == 0;
+            datum.exponent--;
+        }
+
+        datum.head += "{\"propertyId\":\"";
+        datum.head += name;
+        datum.head += "\",\"propertyType\":\"";
+        datum.head += propertyType;
+        datum.head += "\",\"propertyName\":\"";
+        datum.head += name;
+        datum.head += "\",\"propertyDescription\":\"";
+        datum.head += name;
+        datum.head += "\",\"valueType\":\"";
+        datum.head += info.valueType;
+        datum.head += "\",\"value\":\"";
+
+        sensor.datums.resize(std::max(sensor.datums.size(), (size_t)index + 1));
+        sensor.datums[index] = datum;
+
+        return sensor.datums[index];
+    }
+
+    void AppendInteger(int64_t value, int minDigits = 1)
+    {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+
+        for (int padding = minDigits - (int)(result.ptr - digits); padding > 0; padding--)
+        {
+            buffer += '0';
+        }
+
+        buffer.append(digits, result.ptr);
+    }
+
+    // Scaled values are written with six decimals. A decimal fraction is written
+    // from the raw value and the exponent, as in CBOR, so no float rounding creeps in.
+    void AppendValue(int64_t raw, bool isNumber, const DatumTemplate &datum)
+    {
+        if (!isNumber)
+        {
+            return;
+        }
+
+        if (datum.info->divisor == 0)
+        {
+            AppendInteger(raw);
+
+            return;
+        }
+
+        if (!datum.decimal || datum.exponent < -6)
+        {
+            char digits[64];
+
+            snprintf(digits, sizeof(digits), "%f", raw / datum.info->divisor);
+            buffer += digits;
+
+            return;
+        }
+
+        uint64_t scale = 1;
+        uint64_t magnitude = raw < 0 ? 0 - (uint64_t)raw : raw;
+        char digits[24];
+
+        for (int i = datum.exponent; i < 0; i++)
+        {
+            scale *= 10;
+        }
+
+        if (raw < 0)
+        {
+            buffer += '-';
+        }
+
+        auto result = std::to_chars(digits, digits + sizeof(digits), magnitude / scale);
+
+        buffer.append(digits, result.ptr);
+        buffer += '.';
+
+        if (scale > 1)
+        {
+            AppendInteger(magnitude % scale, -datum.exponent);
+        }
+
+        buffer.append(6 + std::min(0, datum.exponent), '0');
+    }
+
+    // UTC time of the reading, formatted once for all readings within a second.
+    const char *Timestamp(time_t currentTime)
+    {
+        if (currentTime != timestampTime)
+        {
+            struct tm utc;
+
+            gmtime_r(&currentTime, &utc);
+            strftime(timestamp, sizeof(timestamp), "%FT%TZ", &utc);
+            timestampTime = currentTime;
+        }
+
+        return timestamp;
+    }
+
+    std::unordered_map<uint32_t, SensorTemplate> sensors;
+    std::string buffer;
+    time_t timestampTime;
+    char timestamp[sizeof "0000-00-00T00:00:00Z"];
+};
@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <time.h>
+
+#include <chrono>
+
+// Alarms are state changes that someone may have to act on, such as water being
+// detected or a door opening. Sinks deliver them ahead of routine telemetry.
+enum class DeviceDataPriority
+{
+    Telemetry,
+    Alarm
+};
+
+const int SensorSampleMaxDatums = 2;
+
+// Fixed-size record of a sensor message, all the radio thread hands over to a
+// sink. Sinks encode samples on their own thread when they batch them.
+struct SensorSample
+{
+    uint32_t gatewayId;
+    uint32_t deviceId;
+    time_t timestamp;
+    uint32_t sequence; // counts the samples of the gateway, with the IDs and timestamp it identifies the reading
+    uint16_t sensorType;
+    uint16_t batteryVoltage; // hundredths of a volt
+    int8_t rssi;
+    uint8_t datumCount;
+    uint8_t numberDatums; // bit i is clear for a datum without a value, such as ASSET
+    DeviceDataPriority priority;
+
+    struct
+    {
+        const char *name; // Tarts datum names are string literals
+        int64_t value;    // raw value as reported, unscaled, wide enough for the uint32 values of some sensors
+    } datums[SensorSampleMaxDatums];
+
+    bool IsNumber(int datum) const
+    {
+        return (numberDatums >> datum) & 1;
+    }
+};
+
+static_assert(sizeof(SensorSample) <= 64, "a SensorSample should fit in a cache line");
+
+// Destination of the device data readings: the jottai REST API (Http) or a
+// broker (MqttPublisher). Implementations hand samples over to a worker thread
+// of their own and never block the thread running Tarts.Process.
+struct DeviceDataSink
+{
+    virtual ~DeviceDataSink() = default;
+
+    // Returns false, without waiting, when the sink's queue is full.
+    virtual bool EnqueueDeviceData(const SensorSample &sample) = 0;
+
+    virtual WireFormat DeviceDataFormat() const = 0;
+
+    // Delivers what the sink holds until deadline, then stores or reports what is
+    // left and stops the worker. Called once at shutdown, after the radio stopped.
+    virtual void Drain(std::chrono::steady_clock::time_point deadline) = 0;
+};
@@ -7,5 +7,16 @@ export JOTTAI_API_HOST=http://REPLACE_WITH_JOTTAI_API_HOST/jottai/api/sensor-dat
 export JOTTAI_API_KEY=REPLACE_WITH_JOTTAI_API_KEY
 export JOTTAI_ID=REPLACE_WITH_JOTTAI_BOT_ID
 export GATEWAY_ID=REPLACE_WITH_TARTS_GATEWAY_ID
+# keeps undelivered readings on disk across uplink outages and restarts
+# export JOTTAI_OUTBOX_DIR=/var/lib/jottai/outbox
+# reuses a still valid access token after a restart instead of waiting for a new one
+# export JOTTAI_TOKEN_CACHE=/var/lib/jottai/access-token
+# registers the sensors found earlier again at start
+# export JOTTAI_SENSOR_REGISTRY=/var/lib/jottai/sensors
+# publishes device data to an MQTT broker instead of the jottai REST API, with the
+# outbox set readings not acknowledged at shutdown are kept in its mqtt subdirectory
+# export JOTTAI_MQTT_HOST=REPLACE_WITH_MQTT_BROKER_HOST
+# also sends every reading to these agents, separated by commas
+# export JOTTAI_MIRROR_HOSTS=http://REPLACE_WITH_MIRROR_HOST/jottai/api/sensor-data/
 ./build.sh
 ./TartsWebClient